@@ -5,10 +5,11 @@ static const char *const HELP = "Generates a 3D cone";
 
 #include "DDImage/SourceGeo.h"
 #include "DDImage/Scene.h"
-#include "DDImage/Triangle.h"
+#include "DDImage/PolyMesh.h"
 #include "DDImage/Knobs.h"
 #include "DDImage/Knob.h"
 #include "DDImage/Channel3D.h"
+#include "ConeLayout.h"
 #include <math.h>
 #include <assert.h>
 
@@ -19,7 +20,18 @@ using namespace DD::Image;
 #define mFnStringize(A) mFnStringize2(A)
 #endif
 
-#define MAX_CONE_TESSELATION 512
+// Adds cone_triangles' triangles to a mesh; each face's vertices follow the
+// previous face's.
+struct MeshTriangles
+{
+  PolyMesh* mesh;
+  MeshTriangles(PolyMesh* m) : mesh(m) {}
+  void operator()(unsigned v0, unsigned v1, unsigned v2)
+  {
+    const unsigned verts[3] = { v0, v1, v2 };
+    mesh->add_face(3, verts);
+  }
+};
 
 class Cone : public SourceGeo
 {
@@ -168,15 +180,17 @@ public:
       out[i].matrix = _local * out[i].matrix;
   }
 
+  /* The cone is a ring of points per row, from the base ring (row 0) up
+     to the ring one row below the pinnacle, plus the base centre and the
+     pinnacle. The faces come from cone_triangles in ConeLayout.h. */
   void create_geometry(Scene& scene, GeometryList& out)
   {
     int obj = 0;
 
-    // std::cout << "rows: " << rows << std::endl;
-    // std::cout << "cols: " << columns << std::endl;
-
-    unsigned num_points = 1 + rows * columns + 1; // base + mesh + pinnacle
-    // std::cout << "num points: " << num_points << std::endl;
+    const ConeLayout layout(rows, columns);
+    const unsigned num_points = layout.points;
+    const unsigned num_faces = layout.faces;
+    const unsigned num_verts = layout.vertices;
 
     //=============================================================
     // Build the primitives:
@@ -184,42 +198,14 @@ public:
       out.delete_objects();
       out.add_object(obj);
 
-      int row_count = rows;
-
-      // Create poly primitives:
-      // Bottom endcap:
-      int j1 = 1;
-      for (int i = 0; i < columns; i++) { 
-        int i0 = i % columns; 
-        int i1 = (i + 1) % columns; 
-        out.add_primitive(obj, new Triangle(0, i1 + j1, i0 + j1));
-      }
-
-      while (row_count > 1) {
-
-        for (int j = 0; j < rows+1; j++) {
-          int j0 = j * columns + 1; 
-          int j1 = (j + 1) * columns + 1;
-          for (int i = 0; i < columns; i++) {
-            int i0 = i % columns;
-            int i1 = (i+1) % columns;  
-            out.add_primitive(obj, new Triangle(i0+j0, i1+j0, i0+j1));
-            out.add_primitive(obj, new Triangle(i0+j1, i1+j0, i1+j1)); 
-          }  
-        }
-        row_count--;
-      }
-
-      // make the triangles to set the top_point
-      int top_point = num_points - 1;
-      int j0 = 1 + (rows-1) * columns;
-      for (int i = 0; i < columns; i++) {
-        int i0 = i % columns;
-        int i1 = (i+1) % columns;
-        out.add_primitive(obj, new Triangle(i0+j0, i1+j0, top_point));
-      }
+      // One mesh holds every triangle:
+      PolyMesh* mesh = new PolyMesh(num_verts, num_faces);
+      MeshTriangles add(mesh);
+      cone_triangles(rows, columns, add);
+      assert(mesh->faces() == num_faces);
+      out.add_primitive(obj, mesh);
 
-      // Force points and attributes to update:5
+      // Force points and attributes to update:
       set_rebuild(Mask_Points | Mask_Attributes);
     }
 
@@ -231,39 +217,30 @@ public:
       points->resize(num_points);
 
       // Assign the point locations:
-      int p = 0;
+      unsigned p = 0;
       // Bottom center:
       (*points)[p++].set(0.0f, 0.0f, 0.0f);
 
-      // Middle mesh:
-
-      int row_count = rows;
+      // Rings:
       float row_delta = height / float(rows);
       float rad_delta = radius / float(rows);
-      int idx = 0;
-
-      while (row_count > 0) {
-
-        float angle = (2.0 * M_PI) / columns;
-        float exterior_angle = M_PI - angle;
-        float rotation_delta = angle - (0.5 * exterior_angle);
-
-        float y = 0.0 + (row_delta * idx);
+      float angle = (2.0 * M_PI) / columns;
+      float exterior_angle = M_PI - angle;
+      float rotation_delta = angle - (0.5 * exterior_angle);
 
+      for (int idx = 0; idx < rows; idx++) {
+        float y = row_delta * idx;
+        float r = radius - (rad_delta * idx);
         for (int current_angle = 0; current_angle < columns; current_angle++) {
           float new_angle = (angle * current_angle) - rotation_delta;
-          float x = cos(new_angle) * (radius - (rad_delta * idx));
-          float z = sin(new_angle) * (radius - (rad_delta * idx));
-          (*points)[p].set(x, y, z);
-          ++p;
+          (*points)[p++].set(cos(new_angle) * r, y, sin(new_angle) * r);
         }
-        row_count--;
-        idx++;
       }
 
       // set pinnacle
-      (*points)[p].set(0.0f, height, 0.0f);
-      ++p;
+      (*points)[p++].set(0.0f, height, 0.0f);
+      assert(p == num_points);
+    }
 
     //=============================================================
     // Assign the normals and uvs:
@@ -279,7 +256,10 @@ public:
 
       //---------------------------------------------
       // UVs:
-      const Primitive** PRIMS = info.primitive_array();
+      // The mesh's vertices run in the face order of cone_triangles, three
+      // per triangle:
+      const unsigned first_vert = info.primitive(0)->vertex_offset();
+      unsigned v = first_vert;
 
       Attribute* uv = out.writable_attribute(obj, Group_Vertices, "uv", VECTOR4_ATTRIB);
       assert(uv);
@@ -290,54 +270,41 @@ public:
       float s, t;                                             // Current UV
       t = st;
 
-      int row_count = rows;
-      
       // Bottom center:
       s = ss;
       for (int i = 0; i < columns; i++) {
-        unsigned v = (*PRIMS++)->vertex_offset();
         uv->vector4(v++).set(   s, 0.0f, 0.0f, 1.0f);
         uv->vector4(v++).set(s + ds, t + dt, 0.0f, 1.0f);
         uv->vector4(v++).set(   s, t + dt, 0.0f, 1.0f);
         s += ds;
       }
-      // t += dt;
-      t = st;
 
-      // Create the poly mesh in center:
-
-      while (row_count > 1) {
-
-        for (int j = 0; j < (rows - 1); j++) {
-          s = ss;
-          for (int i = 0; i < columns; i++) {
-            unsigned v = (*PRIMS++)->vertex_offset();
-            uv->vector4(v++).set(   s,    t, 0.0f, 1.0f);
-            uv->vector4(v++).set(s + ds,    t, 0.0f, 1.0f);
-            uv->vector4(v++).set(   s, t + dt, 0.0f, 1.0f);
-            v = (*PRIMS++)->vertex_offset();
-            uv->vector4(v++).set(   s, t + dt, 0.0f, 1.0f);
-            uv->vector4(v++).set(s + ds,    t, 0.0f, 1.0f);
-            uv->vector4(v++).set(s + ds, t + dt, 0.0f, 1.0f);
-            s += ds;
-          }
-          t += dt;
+      // Bands:
+      for (int j = 0; j < rows - 1; j++) {
+        s = ss;
+        for (int i = 0; i < columns; i++) {
+          uv->vector4(v++).set(   s,    t, 0.0f, 1.0f);
+          uv->vector4(v++).set(s + ds,    t, 0.0f, 1.0f);
+          uv->vector4(v++).set(   s, t + dt, 0.0f, 1.0f);
+          uv->vector4(v++).set(   s, t + dt, 0.0f, 1.0f);
+          uv->vector4(v++).set(s + ds,    t, 0.0f, 1.0f);
+          uv->vector4(v++).set(s + ds, t + dt, 0.0f, 1.0f);
+          s += ds;
         }
-        row_count--;
+        t += dt;
       }
 
       // Top endcap:
       s = ss;
       for (int i = 0; i < columns; i++) {
-        unsigned v = (*PRIMS++)->vertex_offset();
         uv->vector4(v++).set(   s,    t, 0.0f, 1.0f);
         uv->vector4(v++).set(s + ds,    t, 0.0f, 1.0f);
         uv->vector4(v++).set(   s, 1.0f, 0.0f, 1.0f);
         s += ds;
       }
+      assert(v - first_vert == num_verts);
     }
   }
-}
 
     // virtual
     void build_handles(ViewerContext * ctx)
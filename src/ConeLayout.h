@@ -0,0 +1,65 @@
+// ConeLayout.h
+//
+// Point and triangle layout of the Cone mesh, kept free of DDImage so
+// ConeLayoutCheck can test it for every rows/columns combination.
+
+#ifndef CONE_LAYOUT_H
+#define CONE_LAYOUT_H
+
+// Largest rows and columns the Cone op allows
+#define MAX_CONE_TESSELATION 512
+
+// Sizes of a cone with rows rings of columns points.
+struct ConeLayout
+{
+  unsigned points;   // base centre + rows rings + pinnacle
+  unsigned faces;    // base cap + rows - 1 bands + top cap, all triangles
+  unsigned vertices; // three per face
+
+  ConeLayout(int rows, int columns)
+  {
+    points = 1 + rows * columns + 1;
+    faces = columns + (rows - 1) * columns * 2 + columns;
+    vertices = 3 * faces;
+  }
+};
+
+/* Call add(v0, v1, v2) for every triangle of the cone, in mesh order.
+   Point 0 is the base centre, ring j is points 1 + j * columns onwards and
+   the last point is the pinnacle. Faces are the base cap, one band of two
+   triangles per column between each pair of neighbouring rings, and the
+   top cap, all in one linear pass. */
+template <class AddTriangle>
+inline void cone_triangles(int rows, int columns, AddTriangle& add)
+{
+  // Bottom endcap:
+  int j1 = 1;
+  for (int i = 0; i < columns; i++) {
+    int i0 = i;
+    int i1 = i + 1 < columns ? i + 1 : 0;
+    add(0, i1 + j1, i0 + j1);
+  }
+
+  // One band per pair of rings:
+  for (int j = 0; j < rows - 1; j++) {
+    int j0 = j * columns + 1;
+    int j1 = (j + 1) * columns + 1;
+    for (int i = 0; i < columns; i++) {
+      int i0 = i;
+      int i1 = i + 1 < columns ? i + 1 : 0;
+      add(i0+j0, i1+j0, i0+j1);
+      add(i0+j1, i1+j0, i1+j1);
+    }
+  }
+
+  // make the triangles to set the top_point
+  int top_point = ConeLayout(rows, columns).points - 1;
+  int j0 = 1 + (rows - 1) * columns;
+  for (int i = 0; i < columns; i++) {
+    int i0 = i;
+    int i1 = i + 1 < columns ? i + 1 : 0;
+    add(i0+j0, i1+j0, top_point);
+  }
+}
+
+#endif // CONE_LAYOUT_H
@@ -0,0 +1,102 @@
+//
+//  ConeLayoutCheck.cpp
+//
+//  Checks the Cone mesh layout in ConeLayout.h for every rows/columns
+//  combination the op allows: the face and vertex counts match what
+//  cone_triangles emits and every index is a valid, distinct point. Small
+//  cones and the largest ones are also checked to be closed and
+//  consistently wound: every directed edge is used once and its reverse
+//  once. Build and run with 'make conecheck'.
+//
+
+#include "ConeLayout.h"
+
+#include <stdio.h>
+#include <vector>
+#include <algorithm>
+
+// Largest rows/columns checked for a closed surface as well as the
+// counts, with the four corners of the range
+#define SURFACE_CHECK_SIZE 48
+
+// Counts the triangles and any bad indices
+struct CountTriangles
+{
+  unsigned points, faces, bad;
+  CountTriangles(unsigned p) : points(p), faces(0), bad(0) {}
+  void operator()(unsigned v0, unsigned v1, unsigned v2)
+  {
+    faces++;
+    bad += v0 >= points || v1 >= points || v2 >= points || v0 == v1 || v1 == v2 || v2 == v0;
+  }
+};
+
+// Collects the directed edges of every triangle
+struct CollectEdges
+{
+  std::vector<std::pair<unsigned, unsigned> > edges;
+  void operator()(unsigned v0, unsigned v1, unsigned v2)
+  {
+    edges.push_back(std::make_pair(v0, v1));
+    edges.push_back(std::make_pair(v1, v2));
+    edges.push_back(std::make_pair(v2, v0));
+  }
+};
+
+static bool checkCounts(int rows, int columns)
+{
+  const ConeLayout layout(rows, columns);
+  CountTriangles count(layout.points);
+  cone_triangles(rows, columns, count);
+  if (layout.points != unsigned(rows * columns + 2) || count.faces != layout.faces ||
+      layout.vertices != 3 * count.faces || count.bad) {
+    printf("FAILED: rows %d columns %d: %u points, %u faces (%u emitted), %u vertices, %u bad triangles\n",
+           rows, columns, layout.points, layout.faces, count.faces, layout.vertices, count.bad);
+    return false;
+  }
+  return true;
+}
+
+static bool checkSurface(int rows, int columns)
+{
+  const ConeLayout layout(rows, columns);
+  CollectEdges collect;
+  cone_triangles(rows, columns, collect);
+  std::vector<std::pair<unsigned, unsigned> >& edges = collect.edges;
+  std::sort(edges.begin(), edges.end());
+
+  bool ok = std::adjacent_find(edges.begin(), edges.end()) == edges.end();
+  for (size_t i = 0; ok && i < edges.size(); i++)
+    ok = std::binary_search(edges.begin(), edges.end(), std::make_pair(edges[i].second, edges[i].first));
+
+  // a closed surface of genus 0: V - E + F = 2
+  const long euler = long(layout.points) - long(edges.size() / 2) + long(layout.faces);
+  if (!ok || euler != 2) {
+    printf("FAILED: rows %d columns %d is not a closed, consistently wound surface (V - E + F = %ld)\n",
+           rows, columns, euler);
+    return false;
+  }
+  return true;
+}
+
+int main()
+{
+  int failures = 0;
+  for (int rows = 1; rows <= MAX_CONE_TESSELATION; rows++) {
+    for (int columns = 3; columns <= MAX_CONE_TESSELATION; columns++) {
+      if (!checkCounts(rows, columns))
+        failures++;
+      const bool small = rows <= SURFACE_CHECK_SIZE && columns <= SURFACE_CHECK_SIZE;
+      const bool corner = (rows == 1 || rows == MAX_CONE_TESSELATION) &&
+                          (columns == 3 || columns == MAX_CONE_TESSELATION);
+      if ((small || corner) && !checkSurface(rows, columns))
+        failures++;
+      if (failures >= 10)
+        return 1;
+    }
+  }
+  if (failures)
+    return 1;
+  printf("cone layout: rows 1..%d, columns 3..%d ok\n", MAX_CONE_TESSELATION, MAX_CONE_TESSELATION);
+  return 0;
+}
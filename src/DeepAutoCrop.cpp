@@ -0,0 +1,212 @@
+//
+//  DeepAutoCrop.cpp
+//  DeepAutoCrop Node for Nuke
+//
+//  Shrinks the bbox of a deep stream to the pixels that actually hold samples.
+//
+
+static const char* const RCLASS = "DeepAutoCrop";
+
+static const char* const HELP = "Shrinks the deep bounding box to the pixels that contain samples, "
+                                "so downstream deep nodes skip the empty area.\n"
+                                "The input is scanned once per change and the result is cached.";
+
+#include "DDImage/Knobs.h"
+#include "DDImage/DeepOp.h"
+#include "DDImage/DeepFilterOp.h"
+#include "DDImage/Thread.h"
+
+#include <vector>
+
+using namespace DD::Image;
+
+#define SCAN_ROWS 32 // rows fetched from the input at a time while scanning
+
+/* Shared state for one scan. Each thread writes only its own slot. */
+struct ScanJob
+{
+  DeepOp* in;
+  Op* op;
+  Box box;
+  std::vector<Box> found;   // occupied box per thread
+  std::vector<char> any;    // thread found at least one sample
+  std::vector<char> failed; // thread's deepEngine call failed
+  // (char rather than bool: vector<bool> packs bits, so threads would share bytes)
+};
+
+/* Thread body: scan every nThreads'th block of rows for non-empty pixels. */
+static void scanRows(unsigned index, unsigned nThreads, void* d)
+{
+  ScanJob* job = (ScanJob*)d;
+  const Box& box = job->box;
+
+  int x0 = box.r(), y0 = box.t(), x1 = box.x(), y1 = box.y();
+  bool any = false;
+
+  for (int y = box.y() + int(index) * SCAN_ROWS; y < box.t(); y += int(nThreads) * SCAN_ROWS) {
+    if (job->op->aborted())
+      break;
+
+    const Box rows(box.x(), y, box.r(), MIN(y + SCAN_ROWS, box.t()));
+    DeepPlane plane;
+    if (!job->in->deepEngine(rows, Mask_DeepFront, plane)) {
+      job->failed[index] = 1;
+      break;
+    }
+
+    for (Box::iterator it = rows.begin(); it != rows.end(); it++) {
+      if (plane.getPixel(it).getSampleCount() == 0)
+        continue;
+      x0 = MIN(x0, it.x);
+      y0 = MIN(y0, it.y);
+      x1 = MAX(x1, it.x + 1);
+      y1 = MAX(y1, it.y + 1);
+      any = true;
+    }
+  }
+
+  job->any[index] = any;
+  if (any)
+    job->found[index] = Box(x0, y0, x1, y1);
+}
+
+class DeepAutoCrop : public DeepFilterOp
+{
+  int _pad;
+
+  // Result of the last scan, keyed by the input hash:
+  Lock _cacheLock;
+  Hash _cacheHash;
+  Box _cacheBox;
+  bool _cacheEmpty;
+  bool _cacheValid;
+
+public:
+  void _validate(bool);
+  DeepAutoCrop(Node* node) : DeepFilterOp(node)
+  {
+    _pad = 0;
+    _cacheEmpty = false;
+    _cacheValid = false;
+  }
+  virtual Op* default_input(int idx) const
+  {
+    return NULL;
+  }
+  DeepOp* input0() {
+      return dynamic_cast<DeepOp*>(Op::input(0));
+  }
+  const char* node_shape() const
+  {
+    return DeepOp::DeepNodeShape();
+  }
+
+  virtual bool doDeepEngine(Box box, const ChannelSet& channels, DeepOutputPlane& outPlane)
+  {
+    if (!input0())
+      return true;
+    return input0()->deepEngine(box, channels, outPlane);
+  }
+
+  bool scan(const Box& box, Box& found, bool& empty);
+
+  virtual void knobs(Knob_Callback);
+  const char* Class() const { return RCLASS; }
+  const char* node_help() const { return HELP; }
+  static Iop::Description d;
+};
+
+/* Scan the input's box for pixels with samples, splitting the rows across
+   threads. Returns false if the input failed or the scan was aborted. */
+bool DeepAutoCrop::scan(const Box& box, Box& found, bool& empty)
+{
+  input0()->deepRequest(box, Mask_DeepFront);
+
+  const unsigned nThreads = MAX(1u, MIN(unsigned(Thread::numCPUs), unsigned((box.h() + SCAN_ROWS - 1) / SCAN_ROWS)));
+
+  ScanJob job;
+  job.in = input0();
+  job.op = this;
+  job.box = box;
+  job.found.resize(nThreads);
+  job.any.resize(nThreads, 0);
+  job.failed.resize(nThreads, 0);
+
+  Thread::spawn(scanRows, nThreads, &job);
+  Thread::wait(&job);
+
+  if (aborted())
+    return false;
+
+  empty = true;
+  for (unsigned i = 0; i < nThreads; i++) {
+    if (job.failed[i])
+      return false;
+    if (!job.any[i])
+      continue;
+    if (empty)
+      found = job.found[i];
+    else
+      found.merge(job.found[i]);
+    empty = false;
+  }
+  return true;
+}
+
+void DeepAutoCrop::_validate(bool for_real)
+{
+  DeepFilterOp::_validate(for_real);
+  if (!input0())
+    return;
+
+  const Hash inHash = input0()->op()->hash();
+  const DeepInfo srcDeepInfo = input0()->deepInfo();
+
+  Box found;
+  bool empty = false;
+  bool known = false;
+  {
+    Guard guard(_cacheLock);
+    if (_cacheValid && _cacheHash == inHash) {
+      found = _cacheBox;
+      empty = _cacheEmpty;
+      known = true;
+    }
+  }
+
+  // Scanning pulls the whole input, so only do it when we are about to
+  // render. Until then the input box is passed through.
+  if (!known && for_real && scan(srcDeepInfo.box(), found, empty)) {
+    Guard guard(_cacheLock);
+    _cacheHash = inHash;
+    _cacheBox = found;
+    _cacheEmpty = empty;
+    _cacheValid = true;
+    known = true;
+  }
+
+  if (!known)
+    return;
+
+  Box box;
+  if (empty) {
+    // keep a single pixel rather than a zero sized box
+    box = Box(srcDeepInfo.x(), srcDeepInfo.y(), srcDeepInfo.x() + 1, srcDeepInfo.y() + 1);
+  }
+  else {
+    box = found;
+    box.pad(_pad);
+    box.intersect(srcDeepInfo.box());
+  }
+
+  _deepInfo = DeepInfo(srcDeepInfo.formats(), box, _deepInfo.channels());
+}
+
+void DeepAutoCrop::knobs(Knob_Callback f)
+{
+  Int_knob(f, &_pad, "pad");
+  Tooltip(f, "Pixels to grow the cropped box by on each side");
+}
+
+static Op* build(Node* node) { return new DeepAutoCrop(node); }
+Op::Description DeepAutoCrop::d(RCLASS, "Image/DeepAutoCrop", build);
@@ -0,0 +1,315 @@
+//
+//  DeepChannelMath.cpp
+//  DeepChannelMath Node for Nuke
+//
+//  Applies luma, weighted sum, swizzle or 4x4 matrix math to deep channels.
+//
+
+static const char* const RCLASS = "DeepChannelMath";
+
+static const char* const HELP = "Combine four deep input channels with a 4x4 matrix and write the result "
+                                "into up to four target channels.\n"
+                                "luma: rec709 luma of the first three channels into the first three targets\n"
+                                "weighted sum: weighted sum of the channels into the first target\n"
+                                "swizzle: pick an input channel (or 0/1) for each target\n"
+                                "matrix: full 4x4 matrix, one row per target";
+
+#include "DDImage/Knobs.h"
+#include "DDImage/DeepOp.h"
+#include "DDImage/DeepFilterOp.h"
+#include "DDImage/Convolve.h"
+
+#include "DeepTileArrays.h"
+
+#include <vector>
+#include <algorithm>
+#include <string.h>
+
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+
+using namespace DD::Image;
+
+enum { MODE_LUMA, MODE_WEIGHTED_SUM, MODE_SWIZZLE, MODE_MATRIX };
+static const char* const modes[] = { "luma", "weighted sum", "swizzle", "matrix", 0 };
+
+enum { SWIZZLE_IN0, SWIZZLE_IN1, SWIZZLE_IN2, SWIZZLE_IN3, SWIZZLE_ZERO, SWIZZLE_ONE };
+static const char* const swizzles[] = { "in 0", "in 1", "in 2", "in 3", "0", "1", 0 };
+
+/* y += a * x for count floats. */
+static void addScaled(float a, const float* x, float* y, size_t count)
+{
+  size_t i = 0;
+#ifdef __SSE__
+  const __m128 va = _mm_set1_ps(a);
+  for (; i + 4 <= count; i += 4)
+    _mm_storeu_ps(y + i, _mm_add_ps(_mm_loadu_ps(y + i), _mm_mul_ps(va, _mm_loadu_ps(x + i))));
+#endif
+  for (; i < count; i++)
+    y[i] += a * x[i];
+}
+
+/* out[j] = m[j] . in + bias[j] for count samples held one array per
+   channel. Missing inputs (NULL) read as 0; rows with no out array are
+   skipped. */
+static void applyMatrix(const float m[4][4], const float bias[4], const float* const in[4], float* const out[4],
+                        size_t count)
+{
+  for (int j = 0; j < 4; j++) {
+    if (!out[j])
+      continue;
+    std::fill(out[j], out[j] + count, bias[j]);
+    for (int i = 0; i < 4; i++) {
+      if (in[i] && m[j][i] != 0.0f)
+        addScaled(m[j][i], in[i], out[j], count);
+    }
+  }
+}
+
+class DeepChannelMath : public DeepFilterOp
+{
+  int _mode;
+  Channel _source[4];
+  Channel _target[4];
+  float _weights[4];
+  int _swizzle[4];
+  ConvolveArray _matrixKnob;
+
+  // resolved in _validate:
+  float _m[4][4];
+  float _bias[4];
+  bool _write[4];         // target j is written by the current mode
+  ChannelSet _targets;    // channels this op writes
+
+public:
+  void _validate(bool);
+  DeepChannelMath(Node* node) : DeepFilterOp(node), _matrixKnob()
+  {
+    _mode = MODE_LUMA;
+    _source[0] = _target[0] = Chan_Red;
+    _source[1] = _target[1] = Chan_Green;
+    _source[2] = _target[2] = Chan_Blue;
+    _source[3] = _target[3] = Chan_Alpha;
+    for (int i = 0; i < 4; i++) {
+      _weights[i] = 0.25f;
+      _swizzle[i] = i;
+      _write[i] = false;
+      _bias[i] = 0.0f;
+    }
+    // The knob owns its array and may free or reallocate it, so it gets a
+    // heap copy of the identity default:
+    _matrixKnob.width = 4;
+    _matrixKnob.height = 4;
+    _matrixKnob.array = new float[16];
+    for (int i = 0; i < 16; i++)
+      _matrixKnob.array[i] = (i % 5 == 0) ? 1.0f : 0.0f;
+    memset(_m, 0, sizeof(_m));
+  }
+  virtual Op* default_input(int idx) const
+  {
+    return NULL;
+  }
+  DeepOp* input0() {
+      return dynamic_cast<DeepOp*>(Op::input(0));
+  }
+  const char* node_shape() const
+  {
+    return DeepOp::DeepNodeShape();
+  }
+
+  /*virtual*/
+  void getDeepRequests(Box bbox, const DD::Image::ChannelSet& channels, int count, std::vector<RequestData>& requests) {
+      if (!input0())
+          return;
+      requests.push_back(RequestData(input0(), bbox, inputChannels(channels), count));
+  }
+
+  /* Channels needed from the input to produce channels. */
+  ChannelSet inputChannels(const ChannelSet& channels)
+  {
+    ChannelSet get_channels = channels;
+    get_channels -= _targets;
+    for (int i = 0; i < 4; i++)
+      get_channels += _source[i];
+    get_channels &= input0()->deepInfo().channels();
+    get_channels += Mask_Deep;
+    return get_channels;
+  }
+
+  virtual bool doDeepEngine(Box box, const ChannelSet& channels, DeepOutputPlane& outPlane);
+
+  virtual void knobs(Knob_Callback);
+  int knob_changed(Knob* k);
+  const char* Class() const { return RCLASS; }
+  const char* node_help() const { return HELP; }
+  static Iop::Description d;
+};
+
+/* Reduce every mode to a 4x4 matrix plus bias so the engine only has one
+   kernel to run. */
+void DeepChannelMath::_validate(bool for_real)
+{
+  DeepFilterOp::_validate(for_real);
+
+  memset(_m, 0, sizeof(_m));
+  for (int j = 0; j < 4; j++) {
+    _bias[j] = 0.0f;
+    _write[j] = false;
+  }
+
+  switch (_mode) {
+    case MODE_LUMA:
+      for (int j = 0; j < 3; j++) {
+        _m[j][0] = 0.2126f;
+        _m[j][1] = 0.7152f;
+        _m[j][2] = 0.0722f;
+        _write[j] = true;
+      }
+      break;
+    case MODE_WEIGHTED_SUM:
+      for (int i = 0; i < 4; i++)
+        _m[0][i] = _weights[i];
+      _write[0] = true;
+      break;
+    case MODE_SWIZZLE:
+      for (int j = 0; j < 4; j++) {
+        if (_swizzle[j] <= SWIZZLE_IN3)
+          _m[j][_swizzle[j]] = 1.0f;
+        else if (_swizzle[j] == SWIZZLE_ONE)
+          _bias[j] = 1.0f;
+        _write[j] = true;
+      }
+      break;
+    case MODE_MATRIX:
+      // read through the knob, which may have resized its array; entries
+      // it doesn't have are taken from the identity
+      for (int j = 0; j < 4; j++) {
+        for (int i = 0; i < 4; i++) {
+          if (_matrixKnob.array && i < _matrixKnob.width && j < _matrixKnob.height)
+            _m[j][i] = _matrixKnob.array[j * _matrixKnob.width + i];
+          else
+            _m[j][i] = (i == j) ? 1.0f : 0.0f;
+        }
+        _write[j] = true;
+      }
+      break;
+  }
+
+  _targets = Mask_None;
+  for (int j = 0; j < 4; j++) {
+    if (_target[j] == Chan_Black)
+      _write[j] = false;
+    if (_write[j])
+      _targets += _target[j];
+  }
+
+  ChannelSet out_channels = _deepInfo.channels();
+  out_channels += _targets;
+  _deepInfo = DeepInfo(_deepInfo.formats(), _deepInfo.box(), out_channels);
+}
+
+/* The tile is transposed into one array per channel, the matrix is run
+   over the whole tile a target row at a time, and the tile is written back
+   with the targets taken from the results. */
+bool DeepChannelMath::doDeepEngine(Box box, const ChannelSet& channels, DeepOutputPlane& outPlane)
+{
+  if (!input0())
+    return true;
+
+  DeepPlane inPlane;
+  ChannelSet get_channels = inputChannels(channels);
+  if (!input0()->deepEngine(box, get_channels, inPlane))
+    return false;
+
+  DeepTileArrays tile;
+  tile.load(inPlane, box, get_channels);
+  const size_t total = tile.samples();
+
+  if (Op::aborted())
+    return false;
+
+  const float* src[4];
+  for (int i = 0; i < 4; i++)
+    src[i] = tile.channel(_source[i]);
+
+  std::vector<float> res[4];
+  float* dst[4];
+  for (int j = 0; j < 4; j++) {
+    dst[j] = NULL;
+    if (_write[j] && channels.contains(_target[j])) {
+      res[j].resize(total + 1);
+      dst[j] = &res[j][0];
+    }
+  }
+  applyMatrix(_m, _bias, src, dst, total);
+
+  // Each output channel is a target's result, a copy of the input channel,
+  // or zero when the input doesn't have it:
+  std::vector<const float*> cols;
+  tile.columns(channels, cols);
+  int k = 0;
+  foreach(z, channels) {
+    for (int j = 0; j < 4; j++) {
+      if (dst[j] && _target[j] == z)
+        cols[k] = dst[j];
+    }
+    k++;
+  }
+
+  outPlane = DeepOutputPlane(channels, box);
+  const int nOutputChans = channels.size();
+  for (size_t p = 0; p < tile.pixels(); p++) {
+    if (Op::aborted())
+      return false;
+    DeepOutPixel out_pixel;
+    out_pixel.reserve(tile.count(p) * nOutputChans);
+    tile.getPixel(p, cols, out_pixel);
+    outPlane.addPixel(out_pixel);
+  }
+
+  return true;
+}
+
+void DeepChannelMath::knobs(Knob_Callback f)
+{
+  Enumeration_knob(f, &_mode, modes, "mode");
+  Tooltip(f, "How the input channels are combined into the target channels");
+  Input_Channel_knob(f, _source, 4, 0, "in", "in");
+  Tooltip(f, "The four input channels the math operates on");
+  Channel_knob(f, _target, 4, "out", "out");
+  Tooltip(f, "The channels the results are written to. Set a target to none to leave it alone.");
+
+  Divider(f);
+  MultiFloat_knob(f, _weights, 4, "weights");
+  Tooltip(f, "weighted sum: the weight of each input channel");
+  Enumeration_knob(f, &_swizzle[0], swizzles, "swizzle0", "swizzle");
+  Tooltip(f, "swizzle: source of each target channel");
+  Enumeration_knob(f, &_swizzle[1], swizzles, "swizzle1", "");
+  ClearFlags(f, Knob::STARTLINE);
+  Enumeration_knob(f, &_swizzle[2], swizzles, "swizzle2", "");
+  ClearFlags(f, Knob::STARTLINE);
+  Enumeration_knob(f, &_swizzle[3], swizzles, "swizzle3", "");
+  ClearFlags(f, Knob::STARTLINE);
+  Array_knob(f, &_matrixKnob, 4, 4, "matrix", "matrix");
+  Tooltip(f, "matrix: one row per target channel, one column per input channel");
+}
+
+/* Only the knobs the current mode uses are enabled. Done when the mode
+   changes and when the panel opens, so saved scripts show the right
+   state. */
+int DeepChannelMath::knob_changed(Knob* k)
+{
+  if (!k->is("mode") && k != &Knob::showPanel)
+    return 0;
+  knob("weights")->enable(_mode == MODE_WEIGHTED_SUM);
+  knob("swizzle0")->enable(_mode == MODE_SWIZZLE);
+  knob("swizzle1")->enable(_mode == MODE_SWIZZLE);
+  knob("swizzle2")->enable(_mode == MODE_SWIZZLE);
+  knob("swizzle3")->enable(_mode == MODE_SWIZZLE);
+  knob("matrix")->enable(_mode == MODE_MATRIX);
+  return 1;
+}
+
+static Op* build(Node* node) { return new DeepChannelMath(node); }
+Op::Description DeepChannelMath::d(RCLASS, "Color/DeepChannelMath", build);
@@ -0,0 +1,185 @@
+//
+//  DeepCompact.cpp
+//  DeepCompact Node for Nuke
+//
+//  Merges redundant, near-coincident deep samples to cut sample counts.
+//
+
+static const char* const RCLASS = "DeepCompact";
+
+static const char* const HELP = "Reduces the number of deep samples by merging samples whose depth ranges "
+                                "overlap or lie within the tolerance of each other.\n"
+                                "Merged samples are combined front to back with 'over', so the flattened "
+                                "result is unchanged. Channels not in the merge channels take the value of "
+                                "the front-most sample.\n"
+                                "The reduction knob shows how many input samples went into each output "
+                                "sample for the last render.";
+
+#include "DDImage/Knobs.h"
+#include "DDImage/DeepOp.h"
+#include "DDImage/DeepFilterOp.h"
+#include "DDImage/Thread.h"
+
+#include "DeepSampleMerge.h"
+
+#include <vector>
+#include <algorithm>
+
+using namespace DD::Image;
+using namespace DeepSampleMerge;
+
+class DeepCompact : public DeepFilterOp
+{
+  float _tolerance;
+  ChannelSet _mergeChannels;  // combined with 'over'
+  double _reduction;          // display only
+
+  // sample counts for the current render, across all tiles:
+  Lock _statsLock;
+  Hash _statsHash;
+  double _samplesIn;
+  double _samplesOut;
+
+public:
+  void _validate(bool);
+  DeepCompact(Node* node) : DeepFilterOp(node)
+  {
+    _tolerance = 0.0f;
+    _mergeChannels = Mask_RGBA;
+    _reduction = 1.0;
+    _samplesIn = _samplesOut = 0.0;
+  }
+  virtual Op* default_input(int idx) const
+  {
+    return NULL;
+  }
+  DeepOp* input0() {
+      return dynamic_cast<DeepOp*>(Op::input(0));
+  }
+  const char* node_shape() const
+  {
+    return DeepOp::DeepNodeShape();
+  }
+
+  /*virtual*/
+  void getDeepRequests(Box bbox, const DD::Image::ChannelSet& channels, int count, std::vector<RequestData>& requests) {
+      if (!input0())
+          return;
+      DD::Image::ChannelSet get_channels = channels;
+      get_channels += Mask_Deep;
+      get_channels += Mask_Alpha;
+      requests.push_back(RequestData(input0(), bbox, get_channels, count));
+  }
+
+  /*virtual*/
+  bool updateUI(const OutputContext& context) {
+      Guard guard(_statsLock);
+      const double reduction = _samplesOut > 0.0 ? _samplesIn / _samplesOut : 1.0;
+      knob("reduction")->set_value(reduction);
+      return true;
+  }
+
+  virtual bool doDeepEngine(Box box, const ChannelSet& channels, DeepOutputPlane& outPlane);
+  virtual void knobs(Knob_Callback);
+  const char* Class() const { return RCLASS; }
+  const char* node_help() const { return HELP; }
+  static Iop::Description d;
+};
+
+void DeepCompact::_validate(bool for_real)
+{
+  DeepFilterOp::_validate(for_real);
+
+  // Start counting again whenever the output changes:
+  Guard guard(_statsLock);
+  if (_statsHash != hash()) {
+    _statsHash = hash();
+    _samplesIn = _samplesOut = 0.0;
+  }
+}
+
+bool DeepCompact::doDeepEngine(Box box, const ChannelSet& channels, DeepOutputPlane& outPlane)
+{
+  if (!input0())
+    return true;
+
+  DeepPlane inPlane;
+  ChannelSet get_channels = channels;
+  get_channels += Mask_Deep;
+  get_channels += Mask_Alpha;
+  if (!input0()->deepEngine(box, get_channels, inPlane))
+    return false;
+
+  outPlane = DeepOutputPlane(channels, box);
+
+  const bool hasAlpha = input0()->deepInfo().channels().contains(Chan_Alpha);
+
+  // Resolve the channel layout once for the tile:
+  const int nOutputChans = channels.size();
+  std::vector<Channel> chans;
+  std::vector<int> roles;
+  channelRoles(channels, _mergeChannels, chans, roles);
+
+  DeepSampleOrder sampleOrder(inPlane, box);
+  std::vector<float> acc(nOutputChans);
+  size_t tileIn = 0, tileOut = 0;
+
+  for (Box::iterator it = box.begin(); it != box.end(); it++) {
+    if (Op::aborted())
+      return false;
+
+    DeepPixel in_pixel = inPlane.getPixel(it);
+    const unsigned nSamples = in_pixel.getSampleCount();
+    tileIn += nSamples;
+
+    // Walk the samples front to back growing groups of samples that
+    // overlap the group so far:
+    const DeepSampleOrder::Samples samples = sampleOrder.get(it);
+    const unsigned* order = samples.order;
+    const float* front = samples.front;
+    const float* back = samples.back;
+
+    DeepOutPixel out_pixel;
+    out_pixel.reserve(nSamples * nOutputChans);
+    unsigned nGroups = 0;
+
+    for (unsigned g = 0; g < nSamples; ) {
+      float groupBack = back[order[g]];
+      unsigned s = g + 1;
+      for (; s < nSamples && front[order[s]] <= groupBack + _tolerance; s++)
+        groupBack = MAX(groupBack, back[order[s]]);
+
+      mergeRun(in_pixel, &order[g], s - g, chans, roles, hasAlpha, acc, out_pixel);
+      nGroups++;
+      g = s;
+    }
+
+    tileOut += nGroups;
+    outPlane.addPixel(out_pixel);
+  }
+
+  Guard guard(_statsLock);
+  _samplesIn += double(tileIn);
+  _samplesOut += double(tileOut);
+
+  return true;
+}
+
+void DeepCompact::knobs(Knob_Callback f)
+{
+  Float_knob(f, &_tolerance, "tolerance");
+  SetRange(f, 0, 1);
+  Tooltip(f, "Samples closer in depth than this to the samples in front of them are merged with them. "
+             "At 0 only overlapping or touching samples are merged.");
+  Input_ChannelMask_knob(f, &_mergeChannels, 0, "merge_channels", "merge channels");
+  Tooltip(f, "Premultiplied channels that are combined with 'over' when samples merge. "
+             "Other channels keep the value of the front-most sample.");
+  Divider(f);
+  Double_knob(f, &_reduction, "reduction", "reduction");
+  SetFlags(f, Knob::EARLY_STORE | Knob::NO_ANIMATION | Knob::DO_NOT_WRITE | Knob::NO_RERENDER);
+  ClearFlags(f, Knob::SLIDER);
+  Tooltip(f, "Input samples per output sample in the last render");
+}
+
+static Op* build(Node* node) { return new DeepCompact(node); }
+Op::Description DeepCompact::d(RCLASS, "Image/DeepCompact", build);
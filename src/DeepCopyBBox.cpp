@@ -3,30 +3,49 @@
 #include "DDImage/DeepFilterOp.h"
 #include "DDImage/Knobs.h"
 
+#include "DeepTileIndex.h"
+#include "DeepSampleOrder.h"
+
+#include <math.h>
+#include <vector>
+#include <algorithm>
+#include <limits>
+
 static const char* CLASS = "DeepCopyBBox";
 
 using namespace DD::Image;
 
+/* Compares a depth with the DeepFront of a sample index, either way round,
+   for binary searches over a front to back sample order. */
+struct FrontCompare
+{
+  const float* front;
+  FrontCompare(const float* f) : front(f) {}
+  bool operator()(unsigned a, float z) const { return front[a] < z; }
+  bool operator()(float z, unsigned b) const { return z < front[b]; }
+};
+
 class DeepCopyBBox : public DeepFilterOp
 {
-  //
-  // float _zrange[2];
-  // bool _useZMin;
-  // bool _useZMax;
-  // bool _outsideZRange;
+  float _zrange[2];
+  bool _useZMin;
+  bool _useZMax;
+  bool _outsideZRange;
 
   float _bbox[4];
   bool _useBBox;
   bool _outsideBBox;
 
+  DeepTileIndex _tileIndex;
+
 public:
 
   int minimum_inputs() const { return 2; }
   int maximum_inputs() const { return 2; }
 
   DeepCopyBBox(Node* node) : DeepFilterOp(node) {
-    // _zrange[0] = 1;
-    // _zrange[1] = 2;
+    _zrange[0] = 1;
+    _zrange[1] = 2;
 
     _bbox[0] = _bbox[2] = input_format().width();
     _bbox[1] = _bbox[3] = input_format().height();
@@ -37,11 +56,11 @@ public:
     _bbox[2] *= 0.8;
     _bbox[3] *= 0.8;
 
-    // _useZMin = true;
-    // _useZMax = true;
+    _useZMin = false;
+    _useZMax = false;
     _useBBox = true;
 
-    // _outsideZRange = false;
+    _outsideZRange = false;
     _outsideBBox = false;
   }
 
@@ -70,22 +89,22 @@ public:
 
   void knobs(Knob_Callback f)
   {
-    // Float_knob(f, &_zrange[0], "znear");
-    // SetRange(f, 0, 1);
-    // Tooltip(f, "The near deep value");
-
-    // Bool_knob(f, &_useZMin, "use_znear", "use");
-    // Tooltip(f, "Whether to use the near deep value");
-    //
-    // Float_knob(f, &_zrange[1], "zfar");
-    // SetRange(f, 0, 1);
-    // Tooltip(f, "The far deep value");
-    //
-    // Bool_knob(f, &_useZMax, "use_zfar", "use");
-    // Tooltip(f, "Whether to use the far deep value");
-    //
-    // Bool_knob(f, &_outsideZRange, "outside_zrange", "keep outside zrange");
-    // Tooltip(f, "Whether to keep the samples with deep between the range (false), or outside the range (true)");
+    Float_knob(f, &_zrange[0], "znear");
+    SetRange(f, 0, 1);
+    Tooltip(f, "The near deep value");
+
+    Bool_knob(f, &_useZMin, "use_znear", "use");
+    Tooltip(f, "Whether to use the near deep value");
+
+    Float_knob(f, &_zrange[1], "zfar");
+    SetRange(f, 0, 1);
+    Tooltip(f, "The far deep value");
+
+    Bool_knob(f, &_useZMax, "use_zfar", "use");
+    Tooltip(f, "Whether to use the far deep value");
+
+    Bool_knob(f, &_outsideZRange, "outside_zrange", "keep outside zrange");
+    Tooltip(f, "Whether to keep the samples with deep between the range (false), or outside the range (true)");
 
     BBox_knob(f, &_bbox[0], "bbox");
     SetFlags(f, Knob::ALWAYS_SAVE);
@@ -100,83 +119,252 @@ public:
 
   int knob_changed(DD::Image::Knob* k)
   {
-    // knob("znear")->enable(_useZMin);
-    // knob("zfar")->enable(_useZMax);
+    knob("znear")->enable(_useZMin);
+    knob("zfar")->enable(_useZMax);
     knob("bbox")->enable(_useBBox);
     return 1;
   }
 
-  // void _request(int x, int y, int r, int t, ChannelMask channels, int count)
-  // {
-  //
-  //
-  //
-  //
-  // }
+  /* The 2D box samples are kept inside, or an empty box if the bbox is
+     not in use or samples outside it are kept. Pixels are kept when
+     x >= bbox.x and x < bbox.r, the same test as the per-pixel path, which
+     for integer x is ceil(bbox.x) <= x < ceil(bbox.r). */
+  Box clipBox() const
+  {
+    if (!_useBBox || _outsideBBox)
+      return Box();
+    return Box(int(ceil(_bbox[0])), int(ceil(_bbox[1])), int(ceil(_bbox[2])), int(ceil(_bbox[3])));
+  }
 
-  void _validate(bool for_real)
+  bool keepInside() const
+  {
+    return _useBBox && !_outsideBBox;
+  }
+
+  static bool isEmpty(const Box& box)
   {
-    _deepInfo = dynamic_cast<DeepOp*>(Op::input(1))->deepInfo();
+    return box.x() >= box.r() || box.y() >= box.t();
+  }
 
-    // input(1)->request( x, y, r, t, channels, count );
-    _bbox[0] = _deepInfo.x();
-    _bbox[1] = _deepInfo.r();
-    _bbox[2] = _deepInfo.t();
-    _bbox[3] = _deepInfo.y();
+  static void addHoles(DeepOutputPlane& plane, int count)
+  {
+    for (int i = 0; i < count; i++)
+      plane.addHole();
+  }
+
+  void _validate(bool for_real)
+  {
+    DeepOp* bboxInput = dynamic_cast<DeepOp*>(Op::input(1));
+    if (bboxInput) {
+      bboxInput->validate(for_real);
+      const DeepInfo& bboxInfo = bboxInput->deepInfo();
+
+      _bbox[0] = bboxInfo.x();
+      _bbox[1] = bboxInfo.y();
+      _bbox[2] = bboxInfo.r();
+      _bbox[3] = bboxInfo.t();
+    }
 
     DeepFilterOp::_validate(for_real);
-    if (_useBBox && !_outsideBBox) {
+    if (keepInside()) {
       _deepInfo.box().set(floor(_bbox[0] - 1), floor(_bbox[1] - 1), ceil(_bbox[2] + 1), ceil(_bbox[3] + 1));
     }
   }
 
+  bool useZRange() const
+  {
+    return _useZMin || _useZMax;
+  }
+
+  /*! Only ask the input for the part of the request inside the copied bbox.
+  */
+  /*virtual*/
+  void getDeepRequests(Box bbox, const DD::Image::ChannelSet& channels, int count, std::vector<RequestData>& requests)
+  {
+    if (!input0())
+      return;
+
+    if (keepInside()) {
+      bbox.intersect(clipBox());
+      if (isEmpty(bbox))
+        return;
+    }
+
+    DD::Image::ChannelSet get_channels = channels;
+    if (useZRange())
+      get_channels += DeepTileIndex::channels();
+    requests.push_back(RequestData(input0(), bbox, get_channels, count));
+  }
+
+  enum { Z_CLIP, Z_KEEP_ALL, Z_DROP_ALL };
+
+  /* Decide from a tile's summary whether the z range keeps every sample of
+     the tile, none of them, or has to be tested per sample. */
+  int zTest(const DeepTileSummary& summary) const
+  {
+    if (summary.empty())
+      return Z_KEEP_ALL;
+
+    const float zNear = _useZMin ? _zrange[0] : -std::numeric_limits<float>::infinity();
+    const float zFar = _useZMax ? _zrange[1] : std::numeric_limits<float>::infinity();
+    if (summary.within(zNear, zFar))
+      return _outsideZRange ? Z_DROP_ALL : Z_KEEP_ALL;
+    if (summary.clear(zNear, zFar))
+      return _outsideZRange ? Z_KEEP_ALL : Z_DROP_ALL;
+    return Z_CLIP;
+  }
+
+  /* Fetch box from in, unless the tile index already knows the z range
+     drops all of it, and set zTile to what the z range does to the tile.
+     Tiles the index hasn't seen are summarised from the fetched plane. */
+  bool fetchTile(DeepOp* in, const Box& box, ChannelSet needed, DeepPlane& inPlane, int& zTile)
+  {
+    zTile = Z_KEEP_ALL;
+    if (!useZRange())
+      return in->deepEngine(box, needed, inPlane);
+
+    DeepTileSummary summary;
+    const bool known = _tileIndex.find(in, box, summary);
+    if (known) {
+      zTile = zTest(summary);
+      if (zTile == Z_DROP_ALL)
+        return true;
+    }
+    else {
+      needed += DeepTileIndex::channels();
+    }
+
+    if (!in->deepEngine(box, needed, inPlane))
+      return false;
+    if (!known) {
+      _tileIndex.add(in, box, inPlane, summary);
+      zTile = zTest(summary);
+    }
+    return true;
+  }
+
+  /* Copy the samples of pixel that pass the z range test. The samples are
+     taken in depth order, so the kept range is found with two binary
+     searches and copied as one run (or two when keeping the outside). */
+  void addZClipped(const DeepPixel& pixel, const DeepSampleOrder::Samples& samples, const std::vector<Channel>& chans,
+                   DeepOutputPlane& plane) const
+  {
+    const unsigned nSamples = samples.count;
+    const unsigned* first = samples.order;
+    const FrontCompare compare(samples.front);
+    const unsigned lo = _useZMin ? unsigned(std::lower_bound(first, first + nSamples, _zrange[0], compare) - first) : 0;
+    const unsigned hi = _useZMax ? unsigned(std::upper_bound(first + lo, first + nSamples, _zrange[1], compare) - first) : nSamples;
+
+    const int nOutputChans = chans.size();
+    const unsigned nKept = _outsideZRange ? nSamples - (hi - lo) : hi - lo;
+
+    DeepOutPixel pels;
+    pels.reserve(nKept * nOutputChans);
+
+    if (_outsideZRange) {
+      copySamples(pixel, first, lo, chans, pels);
+      if (hi < nSamples)
+        copySamples(pixel, first + hi, nSamples - hi, chans, pels);
+    }
+    else if (hi > lo) {
+      copySamples(pixel, first + lo, hi - lo, chans, pels);
+    }
+
+    plane.addPixel(pels);
+  }
+
+  static void copySamples(const DeepPixel& pixel, const unsigned* samples, unsigned count,
+                          const std::vector<Channel>& chans, DeepOutPixel& pels)
+  {
+    const int nOutputChans = chans.size();
+    for (unsigned i = 0; i < count; i++) {
+      for (int c = 0; c < nOutputChans; c++)
+        pels.push_back(pixel.getUnorderedSample(samples[i], chans[c]));
+    }
+  }
+
   bool doDeepEngine(DD::Image::Box box, const ChannelSet& channels, DeepOutputPlane& plane)
   {
-    // if (!input0())
-    //   return true;
+    if (!input0())
+      return true;
 
     DeepOp* in = input0();
     DeepPlane inPlane;
 
     ChannelSet needed = channels;
-    needed += Mask_DeepFront;
+    if (useZRange())
+      needed += Mask_Deep;
 
-    if (!in->deepEngine(box, needed, inPlane))
-      return false;
+    std::vector<Channel> chans;
+    foreach (channel, channels)
+      chans.push_back(channel);
 
     plane = DeepOutputPlane(channels, box);
 
-    for (DD::Image::Box::iterator it = box.begin(); it != box.end(); it++) {
+    // Keeping the inside of the bbox: fetch only the intersection, copy its
+    // pixels through and fill the rest with empty pixels.
+    if (keepInside()) {
+      Box inner = box;
+      inner.intersect(clipBox());
+
+      int zTile = Z_DROP_ALL;
+      if (!isEmpty(inner) && !fetchTile(in, inner, needed, inPlane, zTile))
+        return false;
+      if (zTile == Z_DROP_ALL) {
+        addHoles(plane, box.w() * box.h());
+        return true;
+      }
+      const bool useZ = zTile == Z_CLIP;
+      DeepSampleOrder sampleOrder(inPlane, inner);
 
-      const int x = it.x;
-      const int y = it.y;
+      addHoles(plane, (inner.y() - box.y()) * box.w());
 
-      bool inXY = (x >= _bbox[0] && x < _bbox[2] && y >= _bbox[1] && y < _bbox[3]);
+      for (int y = inner.y(); y < inner.t(); y++) {
+        if (Op::aborted())
+          return false;
 
-      if (_useBBox && inXY == _outsideBBox) {
-        plane.addHole();
-        continue;
+        addHoles(plane, inner.x() - box.x());
+        for (int x = inner.x(); x < inner.r(); x++) {
+          if (useZ)
+            addZClipped(inPlane.getPixel(y, x), sampleOrder.get(x, y), chans, plane);
+          else
+            plane.addPixel(inPlane.getPixel(y, x));
+        }
+        addHoles(plane, box.r() - inner.r());
       }
 
-      DeepPixel pixel = inPlane.getPixel(it);
+      addHoles(plane, (box.t() - inner.t()) * box.w());
+      return true;
+    }
 
-      DeepOutPixel pels(pixel.getSampleCount() * channels.size());
+    int zTile;
+    if (!fetchTile(in, box, needed, inPlane, zTile))
+      return false;
+    if (zTile == Z_DROP_ALL) {
+      addHoles(plane, box.w() * box.h());
+      return true;
+    }
+    const bool useZ = zTile == Z_CLIP;
+    DeepSampleOrder sampleOrder(inPlane, box);
 
-      for (size_t sample = 0; sample < pixel.getSampleCount(); sample++) {
+    for (DD::Image::Box::iterator it = box.begin(); it != box.end(); it++) {
+      if (Op::aborted())
+        return false;
 
-        float z = pixel.getUnorderedSample(sample, DD::Image::Chan_DeepFront);
+      const int x = it.x;
+      const int y = it.y;
 
-        // bool inZ = (!_useZMax || z <= _zrange[1]) && (!_useZMin || z >= _zrange[0]);
-        //
-        // if ((_useZMin || _useZMax) && inZ == _outsideZRange)
-        //   continue;
+      bool inXY = (x >= _bbox[0] && x < _bbox[2] && y >= _bbox[1] && y < _bbox[3]);
 
-        foreach (channel, channels) {
-          pels.push_back(pixel.getUnorderedSample(sample, channel));
-        }
+      if (_useBBox && inXY == _outsideBBox) {
+        plane.addHole();
+        continue;
       }
 
-      plane.addPixel(pels);
+      if (useZ)
+        addZClipped(inPlane.getPixel(it), sampleOrder.get(it), chans, plane);
+      else
+        plane.addPixel(inPlane.getPixel(it));
     }
 
     return true;
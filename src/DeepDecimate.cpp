@@ -0,0 +1,209 @@
+//
+//  DeepDecimate.cpp
+//  DeepDecimate Node for Nuke
+//
+//  Reduces every deep pixel to at most a fixed number of depth bins for fast previews.
+//
+
+static const char* const RCLASS = "DeepDecimate";
+
+static const char* const HELP = "Merges the samples of each pixel into at most 'max samples' depth bins, "
+                                "giving a light-weight level of detail for interactive work.\n"
+                                "log depth: bins are spaced logarithmically between the nearest and "
+                                "furthest sample, so detail is kept close to camera\n"
+                                "alpha: bins hold equal shares of the pixel's opacity, so detail is kept "
+                                "where the pixel actually changes\n"
+                                "Samples in a bin are combined front to back with 'over', so the flattened "
+                                "colour and alpha are the same as the input's.";
+
+#include "DDImage/Knobs.h"
+#include "DDImage/DeepOp.h"
+#include "DDImage/DeepFilterOp.h"
+
+#include "DeepSampleMerge.h"
+
+#include <math.h>
+#include <vector>
+#include <algorithm>
+
+using namespace DD::Image;
+using namespace DeepSampleMerge;
+
+enum { BINS_LOG, BINS_ALPHA };
+static const char* const binModes[] = { "log depth", "alpha", 0 };
+
+class DeepDecimate : public DeepFilterOp
+{
+  int _maxSamples;
+  int _binMode;
+  ChannelSet _mergeChannels;  // combined with 'over'
+
+public:
+  DeepDecimate(Node* node) : DeepFilterOp(node)
+  {
+    _maxSamples = 8;
+    _binMode = BINS_LOG;
+    _mergeChannels = Mask_RGBA;
+  }
+  virtual Op* default_input(int idx) const
+  {
+    return NULL;
+  }
+  DeepOp* input0() {
+      return dynamic_cast<DeepOp*>(Op::input(0));
+  }
+  const char* node_shape() const
+  {
+    return DeepOp::DeepNodeShape();
+  }
+
+  /*virtual*/
+  void getDeepRequests(Box bbox, const DD::Image::ChannelSet& channels, int count, std::vector<RequestData>& requests) {
+      if (!input0())
+          return;
+      DD::Image::ChannelSet get_channels = channels;
+      get_channels += Mask_Deep;
+      get_channels += Mask_Alpha;
+      requests.push_back(RequestData(input0(), bbox, get_channels, count));
+  }
+
+  void binKeys(const DeepPixel& pixel, const DeepSampleOrder::Samples& samples, bool hasAlpha,
+               std::vector<float>& key) const;
+
+  virtual bool doDeepEngine(Box box, const ChannelSet& channels, DeepOutputPlane& outPlane);
+  virtual void knobs(Knob_Callback);
+  const char* Class() const { return RCLASS; }
+  const char* node_help() const { return HELP; }
+  static Iop::Description d;
+};
+
+/* For the pixel's samples taken front to back, compute a key in [0, 1]
+   that never decreases along the order. Sample s goes to bin
+   floor(key[s] * bins), so each bin is a run of consecutive samples. */
+void DeepDecimate::binKeys(const DeepPixel& pixel, const DeepSampleOrder::Samples& samples, bool hasAlpha,
+                           std::vector<float>& key) const
+{
+  const unsigned nSamples = samples.count;
+  const unsigned* order = samples.order;
+  const float* front = samples.front;
+  key.resize(nSamples);
+
+  if (_binMode == BINS_ALPHA && hasAlpha) {
+    // Opacity in front of each sample, as a share of the pixel's total:
+    float covered = 0.0f;
+    for (unsigned s = 0; s < nSamples; s++) {
+      key[s] = covered;
+      covered += (1.0f - covered) * pixel.getUnorderedSample(order[s], Chan_Alpha);
+    }
+    if (covered > 0.0f) {
+      const float scale = 1.0f / covered;
+      for (unsigned s = 0; s < nSamples; s++)
+        key[s] *= scale;
+      return;
+    }
+    // a fully transparent pixel has no opacity to share out; bin by count
+    for (unsigned s = 0; s < nSamples; s++)
+      key[s] = float(s) / float(nSamples);
+    return;
+  }
+
+  const float zNear = front[order[0]];
+  const float zFar = front[order[nSamples - 1]];
+  if (!(zFar > zNear)) {
+    std::fill(key.begin(), key.end(), 0.0f);
+    return;
+  }
+
+  if (zNear > 0.0f) {
+    const float scale = 1.0f / logf(zFar / zNear);
+    for (unsigned s = 0; s < nSamples; s++)
+      key[s] = logf(front[order[s]] / zNear) * scale;
+  }
+  else {
+    // no log spacing through zero depth; fall back to linear
+    const float scale = 1.0f / (zFar - zNear);
+    for (unsigned s = 0; s < nSamples; s++)
+      key[s] = (front[order[s]] - zNear) * scale;
+  }
+}
+
+bool DeepDecimate::doDeepEngine(Box box, const ChannelSet& channels, DeepOutputPlane& outPlane)
+{
+  if (!input0())
+    return true;
+
+  DeepPlane inPlane;
+  ChannelSet get_channels = channels;
+  get_channels += Mask_Deep;
+  get_channels += Mask_Alpha;
+  if (!input0()->deepEngine(box, get_channels, inPlane))
+    return false;
+
+  outPlane = DeepOutputPlane(channels, box);
+
+  const bool hasAlpha = input0()->deepInfo().channels().contains(Chan_Alpha);
+  const unsigned nBins = unsigned(MAX(1, _maxSamples));
+
+  const int nOutputChans = channels.size();
+  std::vector<Channel> chans;
+  std::vector<int> roles;
+  channelRoles(channels, _mergeChannels, chans, roles);
+
+  DeepSampleOrder sampleOrder(inPlane, box);
+  std::vector<float> key;
+  std::vector<float> acc(nOutputChans);
+
+  for (Box::iterator it = box.begin(); it != box.end(); it++) {
+    if (Op::aborted())
+      return false;
+
+    DeepPixel in_pixel = inPlane.getPixel(it);
+    const unsigned nSamples = in_pixel.getSampleCount();
+
+    DeepOutPixel out_pixel;
+
+    // Pixels already within budget are copied as they are:
+    if (nSamples <= nBins) {
+      out_pixel.reserve(nSamples * nOutputChans);
+      for (unsigned i = 0; i < nSamples; i++) {
+        for (int k = 0; k < nOutputChans; k++)
+          out_pixel.push_back(in_pixel.getUnorderedSample(i, chans[k]));
+      }
+      outPlane.addPixel(out_pixel);
+      continue;
+    }
+
+    const DeepSampleOrder::Samples samples = sampleOrder.get(it);
+    binKeys(in_pixel, samples, hasAlpha, key);
+
+    out_pixel.reserve(nBins * nOutputChans);
+    for (unsigned g = 0; g < nSamples; ) {
+      const unsigned bin = MIN(nBins - 1, unsigned(key[g] * float(nBins)));
+      unsigned s = g + 1;
+      while (s < nSamples && MIN(nBins - 1, unsigned(key[s] * float(nBins))) == bin)
+        s++;
+      mergeRun(in_pixel, samples.order + g, s - g, chans, roles, hasAlpha, acc, out_pixel);
+      g = s;
+    }
+
+    outPlane.addPixel(out_pixel);
+  }
+
+  return true;
+}
+
+void DeepDecimate::knobs(Knob_Callback f)
+{
+  Int_knob(f, &_maxSamples, "max_samples", "max samples");
+  SetRange(f, 1, 64);
+  Tooltip(f, "The most samples any output pixel will have. Pixels with fewer samples are left alone.");
+  Enumeration_knob(f, &_binMode, binModes, "bins");
+  Tooltip(f, "log depth: bins spaced logarithmically in depth, finer near camera\n"
+             "alpha: bins holding equal shares of each pixel's opacity");
+  Input_ChannelMask_knob(f, &_mergeChannels, 0, "merge_channels", "merge channels");
+  Tooltip(f, "Premultiplied channels that are combined with 'over' when samples merge. "
+             "Other channels keep the value of the front-most sample.");
+}
+
+static Op* build(Node* node) { return new DeepDecimate(node); }
+Op::Description DeepDecimate::d(RCLASS, "Image/DeepDecimate", build);
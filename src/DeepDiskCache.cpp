@@ -0,0 +1,491 @@
+//
+//  DeepDiskCache.cpp
+//  DeepDiskCache Node for Nuke
+//
+//  Keeps the deep planes of its input in memory-mapped files on disk.
+//
+
+static const char* const RCLASS = "DeepDiskCache";
+
+static const char* const HELP = "Caches every deep tile that passes through it in a file on disk, keyed by "
+                                "the input's hash, so scrubbing back over frames does not re-evaluate "
+                                "expensive deep readers and merges upstream.\n"
+                                "Files hold the raw samples and are memory-mapped when read back. When the "
+                                "directory grows past the size limit the least recently used tiles are "
+                                "deleted.\n"
+                                "compact stores colour and other channels as half floats, halving the "
+                                "size of the cache. Depth is always stored at full precision.";
+
+#include "DDImage/Knobs.h"
+#include "DDImage/DeepOp.h"
+#include "DDImage/DeepFilterOp.h"
+#include "DDImage/Thread.h"
+
+#include "DeepHalf.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+using namespace DD::Image;
+
+#define CACHE_MAGIC 0x31434444  // "DDC1"
+#define CACHE_VERSION 1
+#define CACHE_SUFFIX ".ddc"
+
+#define CACHE_HALF 1  // header flag: non-depth channels are stored as halves
+
+/* Start of every cache file. It is followed by the channel numbers
+   (int32 x nChannels), the first sample of each pixel (uint32 x nPixels + 1)
+   and then the samples. Each sample is one float per channel in channel
+   order. In a CACHE_HALF file the floats hold only the depth channels, and
+   a second block follows with one half per sample for every other channel. */
+struct CacheHeader
+{
+  uint32_t magic;
+  uint32_t version;
+  int32_t x, y, r, t;
+  uint32_t nChannels;
+  uint32_t nPixels;
+  uint32_t nSamples;
+  uint32_t flags;
+};
+
+/* Cache files by last use, oldest first. */
+typedef std::multimap<uint64_t, std::string> CacheUse;
+
+/* Size and last use of one file in the cache directory. */
+struct CacheEntry
+{
+  uint64_t bytes;
+  CacheUse::iterator use;  // this file in the use order
+};
+
+class DeepDiskCache : public DeepFilterOp
+{
+  const char* _cacheDir;
+  float _sizeLimit;     // MB
+  bool _compact;        // store non-depth channels as halves
+
+  // What is in the directory, for eviction:
+  Lock _indexLock;
+  std::string _indexDir;
+  std::map<std::string, CacheEntry> _entries;
+  CacheUse _use;
+  uint64_t _totalBytes;
+  uint64_t _clock;
+  unsigned _tempCount;
+
+public:
+  void _validate(bool);
+  DeepDiskCache(Node* node) : DeepFilterOp(node)
+  {
+    _cacheDir = "";
+    _sizeLimit = 4096.0f;
+    _compact = false;
+    _totalBytes = 0;
+    _clock = 0;
+    _tempCount = 0;
+  }
+  virtual Op* default_input(int idx) const
+  {
+    return NULL;
+  }
+  DeepOp* input0() {
+      return dynamic_cast<DeepOp*>(Op::input(0));
+  }
+  const char* node_shape() const
+  {
+    return DeepOp::DeepNodeShape();
+  }
+
+  std::string directory() const;
+  std::string tilePath(const std::string& dir, const Box& box, const ChannelSet& channels);
+
+  /* Channels kept as floats; the rest are stored as halves in compact mode. */
+  bool storeAsFloat(Channel z) const
+  {
+    return !_compact || z == Chan_DeepFront || z == Chan_DeepBack;
+  }
+
+  bool readTile(const std::string& path, const Box& box, const ChannelSet& channels, DeepOutputPlane& outPlane);
+  uint64_t writeTile(const std::string& path, const Box& box, const ChannelSet& channels, const DeepPlane& plane);
+
+  void loadIndex(const std::string& dir);
+  void touch(const std::string& path, uint64_t bytes);
+  void evict(const std::string& keep);
+
+  virtual bool doDeepEngine(Box box, const ChannelSet& channels, DeepOutputPlane& outPlane);
+  virtual void knobs(Knob_Callback);
+  const char* Class() const { return RCLASS; }
+  const char* node_help() const { return HELP; }
+  static Iop::Description d;
+};
+
+/* The cache directory: the knob, or a folder in Nuke's temp directory. */
+std::string DeepDiskCache::directory() const
+{
+  if (_cacheDir && *_cacheDir)
+    return _cacheDir;
+  const char* temp = getenv("NUKE_TEMP_DIR");
+  return std::string(temp && *temp ? temp : "/tmp") + "/DeepDiskCache";
+}
+
+/* One file per tile, named by the input hash, the box and the channels. */
+std::string DeepDiskCache::tilePath(const std::string& dir, const Box& box, const ChannelSet& channels)
+{
+  Hash key;
+  key.append(input0()->op()->hash().value());
+  key.append(box.x());
+  key.append(box.y());
+  key.append(box.r());
+  key.append(box.t());
+  foreach(z, channels)
+    key.append(int(z));
+  key.append(_compact);
+
+  char name[32];
+  snprintf(name, sizeof(name), "/%016llx" CACHE_SUFFIX, (unsigned long long)key.value());
+  return dir + name;
+}
+
+/* Fill outPlane from the file at path. The file is mapped and, once the
+   header matches the request, a full-float file is already in the plane's
+   layout: each pixel's samples are one run appended straight from the
+   mapping. A compact file has its halves unpacked and interleaved with the
+   depth floats a pixel at a time. Returns false if there is no usable
+   file. */
+bool DeepDiskCache::readTile(const std::string& path, const Box& box, const ChannelSet& channels, DeepOutputPlane& outPlane)
+{
+  const int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+    return false;
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || size_t(st.st_size) < sizeof(CacheHeader)) {
+    close(fd);
+    return false;
+  }
+  const size_t bytes = st.st_size;
+  void* map = mmap(NULL, bytes, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return false;
+
+  // Where each channel lives: an index into the float or the half values
+  // of a sample.
+  const int nOutputChans = channels.size();
+  std::vector<char> isFloat;
+  std::vector<int> slot;
+  int nFloat = 0, nHalf = 0;
+  foreach(z, channels) {
+    isFloat.push_back(storeAsFloat(z));
+    slot.push_back(storeAsFloat(z) ? nFloat++ : nHalf++);
+  }
+
+  const CacheHeader* header = (const CacheHeader*)map;
+  const int32_t* chans = (const int32_t*)(header + 1);
+  const uint32_t* offsets = (const uint32_t*)(chans + header->nChannels);
+  const float* floats = (const float*)(offsets + header->nPixels + 1);
+  const uint16_t* halves = (const uint16_t*)(floats + size_t(header->nSamples) * nFloat);
+
+  const uint32_t nPixels = uint32_t(box.w() * box.h());
+  bool ok = header->magic == CACHE_MAGIC && header->version == CACHE_VERSION &&
+            header->flags == (_compact ? CACHE_HALF : 0u) &&
+            header->x == box.x() && header->y == box.y() && header->r == box.r() && header->t == box.t() &&
+            header->nChannels == uint32_t(nOutputChans) && header->nPixels == nPixels &&
+            (const char*)(halves + size_t(header->nSamples) * nHalf) - (const char*)map == ptrdiff_t(bytes);
+
+  if (ok) {
+    int k = 0;
+    foreach(z, channels)
+      ok = ok && chans[k++] == int32_t(z);
+  }
+  if (ok)
+    ok = offsets[0] == 0 && offsets[nPixels] == header->nSamples;
+  for (uint32_t p = 0; ok && p < nPixels; p++)
+    ok = offsets[p] <= offsets[p + 1];
+
+  if (ok && nHalf == 0) {
+    // The file's channels are the request's, in the same order:
+    outPlane = DeepOutputPlane(channels, box);
+    DeepOutPixel pels;
+    for (uint32_t p = 0; p < nPixels; p++) {
+      pels.clear();
+      pels.insert(pels.end(), floats + size_t(offsets[p]) * nFloat, floats + size_t(offsets[p + 1]) * nFloat);
+      outPlane.addPixel(pels);
+    }
+  }
+  else if (ok) {
+    std::vector<float> unpacked;
+    outPlane = DeepOutputPlane(channels, box);
+    for (uint32_t p = 0; p < nPixels; p++) {
+      const uint32_t nSamples = offsets[p + 1] - offsets[p];
+      const float* f = floats + size_t(offsets[p]) * nFloat;
+      const float* h = f;
+      if (nHalf && nSamples) {
+        unpacked.resize(size_t(nSamples) * nHalf);
+        DeepHalf::toFloats(halves + size_t(offsets[p]) * nHalf, &unpacked[0], unpacked.size());
+        h = &unpacked[0];
+      }
+
+      DeepOutPixel pels;
+      pels.reserve(nSamples * nOutputChans);
+      for (uint32_t i = 0; i < nSamples; i++) {
+        for (int k = 0; k < nOutputChans; k++)
+          pels.push_back(isFloat[k] ? f[i * nFloat + slot[k]] : h[i * nHalf + slot[k]]);
+      }
+      outPlane.addPixel(pels);
+    }
+  }
+
+  munmap(map, bytes);
+  return ok;
+}
+
+/* Write plane to path. The file is written under a temporary name and
+   renamed into place, so readers never see a partial file. Returns the
+   size of the file, or 0 if it could not be written. */
+uint64_t DeepDiskCache::writeTile(const std::string& path, const Box& box, const ChannelSet& channels, const DeepPlane& plane)
+{
+  const int nOutputChans = channels.size();
+  const uint32_t nPixels = uint32_t(box.w() * box.h());
+
+  CacheHeader header;
+  memset(&header, 0, sizeof(header));
+  header.magic = CACHE_MAGIC;
+  header.version = CACHE_VERSION;
+  header.x = box.x();
+  header.y = box.y();
+  header.r = box.r();
+  header.t = box.t();
+  header.nChannels = nOutputChans;
+  header.nPixels = nPixels;
+  header.flags = _compact ? CACHE_HALF : 0u;
+
+  std::vector<int32_t> chans;
+  std::vector<Channel> floatChans, halfChans;
+  foreach(z, channels) {
+    chans.push_back(int32_t(z));
+    if (storeAsFloat(z))
+      floatChans.push_back(z);
+    else
+      halfChans.push_back(z);
+  }
+
+  std::vector<uint32_t> offsets;
+  offsets.reserve(nPixels + 1);
+  offsets.push_back(0);
+  uint64_t total = 0;
+  for (Box::iterator it = box.begin(); it != box.end(); it++) {
+    total += plane.getPixel(it).getSampleCount();
+    offsets.push_back(uint32_t(total));
+  }
+  if (total > 0xffffffffu)
+    return 0;
+  header.nSamples = uint32_t(total);
+
+  char suffix[48];
+  {
+    Guard guard(_indexLock);
+    snprintf(suffix, sizeof(suffix), ".%d.%u.tmp", int(getpid()), _tempCount++);
+  }
+  const std::string temp = path + suffix;
+
+  FILE* file = fopen(temp.c_str(), "wb");
+  if (!file)
+    return 0;
+
+  bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+  ok = ok && (chans.empty() || fwrite(&chans[0], sizeof(int32_t), chans.size(), file) == chans.size());
+  ok = ok && fwrite(&offsets[0], sizeof(uint32_t), offsets.size(), file) == offsets.size();
+
+  // The float block, then the half block:
+  std::vector<float> values;
+  std::vector<uint16_t> packed;
+  for (int block = 0; block < 2; block++) {
+    const std::vector<Channel>& order = block == 0 ? floatChans : halfChans;
+    const int nChans = order.size();
+    if (nChans == 0)
+      continue;
+
+    for (Box::iterator it = box.begin(); ok && it != box.end(); it++) {
+      DeepPixel pixel = plane.getPixel(it);
+      const unsigned nSamples = pixel.getSampleCount();
+      if (nSamples == 0)
+        continue;
+      values.resize(size_t(nSamples) * nChans);
+      float* v = &values[0];
+      for (unsigned i = 0; i < nSamples; i++) {
+        for (int k = 0; k < nChans; k++)
+          *v++ = pixel.getUnorderedSample(i, order[k]);
+      }
+      if (block == 0) {
+        ok = fwrite(&values[0], sizeof(float), values.size(), file) == values.size();
+      }
+      else {
+        packed.resize(values.size());
+        DeepHalf::fromFloats(&values[0], &packed[0], values.size());
+        ok = fwrite(&packed[0], sizeof(uint16_t), packed.size(), file) == packed.size();
+      }
+    }
+  }
+
+  const long bytes = ok ? ftell(file) : 0;
+  ok = (fclose(file) == 0) && ok;
+  if (!ok || rename(temp.c_str(), path.c_str()) != 0) {
+    unlink(temp.c_str());
+    return 0;
+  }
+  return uint64_t(bytes);
+}
+
+/* Rebuild the index from the files already in dir, oldest first by their
+   modification time, so files left by earlier sessions are evicted too. */
+void DeepDiskCache::loadIndex(const std::string& dir)
+{
+  _indexDir = dir;
+  _entries.clear();
+  _use.clear();
+  _totalBytes = 0;
+  _clock = uint64_t(time(NULL));
+
+  DIR* d = opendir(dir.c_str());
+  if (!d)
+    return;
+
+  const size_t suffixLen = strlen(CACHE_SUFFIX);
+  while (struct dirent* e = readdir(d)) {
+    const size_t len = strlen(e->d_name);
+    if (len <= suffixLen || strcmp(e->d_name + len - suffixLen, CACHE_SUFFIX) != 0)
+      continue;
+    const std::string path = dir + "/" + e->d_name;
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0)
+      continue;
+    CacheEntry& entry = _entries[path];
+    entry.bytes = uint64_t(st.st_size);
+    entry.use = _use.insert(std::make_pair(uint64_t(st.st_mtime), path));
+    _totalBytes += entry.bytes;
+  }
+  closedir(d);
+}
+
+/* Mark path as just used, adding it to the index if it is new. */
+void DeepDiskCache::touch(const std::string& path, uint64_t bytes)
+{
+  Guard guard(_indexLock);
+  std::map<std::string, CacheEntry>::iterator found = _entries.find(path);
+  if (found == _entries.end()) {
+    CacheEntry& entry = _entries[path];
+    entry.bytes = bytes;
+    _totalBytes += bytes;
+    found = _entries.find(path);
+  }
+  else {
+    _use.erase(found->second.use);
+  }
+  found->second.use = _use.insert(std::make_pair(++_clock, path));
+  evict(path);
+}
+
+/* Delete least recently used files until the cache fits the size limit,
+   taking them from the front of the use order. keep is never deleted. Open
+   mappings of deleted files stay valid. Called with _indexLock held. */
+void DeepDiskCache::evict(const std::string& keep)
+{
+  const uint64_t limit = uint64_t(MAX(_sizeLimit, 0.0f) * 1024.0 * 1024.0);
+  CacheUse::iterator oldest = _use.begin();
+  while (_totalBytes > limit && _entries.size() > 1 && oldest != _use.end()) {
+    if (oldest->second == keep) {
+      ++oldest;
+      continue;
+    }
+    std::map<std::string, CacheEntry>::iterator entry = _entries.find(oldest->second);
+    unlink(entry->first.c_str());
+    _totalBytes -= entry->second.bytes;
+    _entries.erase(entry);
+    _use.erase(oldest++);
+  }
+}
+
+void DeepDiskCache::_validate(bool for_real)
+{
+  DeepFilterOp::_validate(for_real);
+  if (!for_real)
+    return;
+
+  const std::string dir = directory();
+  mkdir(dir.c_str(), 0777);
+
+  Guard guard(_indexLock);
+  if (dir != _indexDir)
+    loadIndex(dir);
+  evict(std::string());
+}
+
+bool DeepDiskCache::doDeepEngine(Box box, const ChannelSet& channels, DeepOutputPlane& outPlane)
+{
+  if (!input0())
+    return true;
+
+  std::string dir;
+  {
+    Guard guard(_indexLock);
+    dir = _indexDir;
+  }
+  if (dir.empty())
+    dir = directory();
+  const std::string path = tilePath(dir, box, channels);
+
+  if (readTile(path, box, channels, outPlane)) {
+    struct stat st;
+    touch(path, stat(path.c_str(), &st) == 0 ? uint64_t(st.st_size) : 0);
+    return true;
+  }
+
+  DeepPlane inPlane;
+  if (!input0()->deepEngine(box, channels, inPlane))
+    return false;
+
+  outPlane = DeepOutputPlane(channels, box);
+  for (Box::iterator it = box.begin(); it != box.end(); it++)
+    outPlane.addPixel(inPlane.getPixel(it));
+
+  if (Op::aborted())
+    return false;
+
+  const uint64_t bytes = writeTile(path, box, channels, inPlane);
+  if (bytes)
+    touch(path, bytes);
+
+  return true;
+}
+
+void DeepDiskCache::knobs(Knob_Callback f)
+{
+  File_knob(f, &_cacheDir, "cache_dir", "cache directory");
+  Tooltip(f, "Directory the cached tiles are written to. "
+             "Empty uses a DeepDiskCache folder in NUKE_TEMP_DIR.");
+  Float_knob(f, &_sizeLimit, "size_limit", "size limit (MB)");
+  SetRange(f, 256, 65536);
+  Tooltip(f, "When the cached files add up to more than this, the least recently used are deleted");
+  Bool_knob(f, &_compact, "compact");
+  SetFlags(f, Knob::STARTLINE);
+  Tooltip(f, "Store colour and other non-depth channels as half floats. Halves the cache size "
+             "at the cost of precision; DeepFront and DeepBack stay full float.");
+}
+
+static Op* build(Node* node) { return new DeepDiskCache(node); }
+Op::Description DeepDiskCache::d(RCLASS, "Image/DeepDiskCache", build);
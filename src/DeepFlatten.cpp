@@ -0,0 +1,189 @@
+//
+//  DeepFlatten.cpp
+//  DeepFlatten Node for Nuke
+//
+//  Flattens a deep stream to a 2D image by compositing samples front to back.
+//
+
+static const char* const RCLASS = "DeepFlatten";
+
+static const char* const HELP = "Flattens a deep image by compositing each pixel's samples front to back "
+                                "with 'over'.\n"
+                                "Samples are taken from a heap rather than fully sorted, and a pixel stops "
+                                "as soon as its alpha reaches the opaque threshold, so opaque foreground "
+                                "elements only cost their first few samples.";
+
+#include "DDImage/Iop.h"
+#include "DDImage/Row.h"
+#include "DDImage/Knobs.h"
+#include "DDImage/DeepOp.h"
+
+#include "DeepSampleOrder.h"
+
+#include <vector>
+#include <algorithm>
+
+using namespace DD::Image;
+
+class DeepFlatten : public Iop
+{
+  float _opaque; // alpha at which a pixel stops compositing
+
+public:
+  DeepFlatten(Node* node) : Iop(node)
+  {
+    _opaque = 1.0f;
+  }
+
+  int minimum_inputs() const { return 1; }
+  int maximum_inputs() const { return 1; }
+
+  /*virtual*/
+  bool test_input(int idx, Op* op) const
+  {
+    return dynamic_cast<DeepOp*>(op) != NULL;
+  }
+
+  virtual Op* default_input(int idx) const
+  {
+    return NULL;
+  }
+
+  DeepOp* input0()
+  {
+    return dynamic_cast<DeepOp*>(Op::input(0));
+  }
+
+  void _validate(bool for_real)
+  {
+    if (!input0()) {
+      info_.set(Box());
+      set_out_channels(Mask_None);
+      return;
+    }
+
+    input0()->validate(for_real);
+    const DeepInfo& deepInfo = input0()->deepInfo();
+
+    ChannelSet channels = deepInfo.channels();
+    channels -= Mask_Deep;
+
+    info_.set(deepInfo.box());
+    info_.full_size_format(*deepInfo.fullSizeFormat());
+    info_.format(*deepInfo.format());
+    info_.channels(channels);
+    set_out_channels(Mask_All);
+  }
+
+  void _request(int x, int y, int r, int t, ChannelMask channels, int count)
+  {
+    if (!input0())
+      return;
+    ChannelSet get_channels = channels;
+    get_channels += Mask_Deep;
+    get_channels += Mask_Alpha;
+    input0()->deepRequest(Box(x, y, r, t), get_channels, count);
+  }
+
+  void engine(int y, int x, int r, ChannelMask channels, Row& row);
+
+  void knobs(Knob_Callback f)
+  {
+    Float_knob(f, &_opaque, "opaque_threshold", "opaque threshold");
+    SetRange(f, 0.9, 1);
+    Tooltip(f, "Stop compositing a pixel once its alpha reaches this value. "
+               "Lower values skip more samples behind nearly opaque ones.");
+  }
+
+  const char* Class() const { return RCLASS; }
+  const char* node_help() const { return HELP; }
+  static const Iop::Description d;
+};
+
+/* Each call flattens one row; Nuke runs rows on all its threads. */
+void DeepFlatten::engine(int y, int x, int r, ChannelMask channels, Row& row)
+{
+  row.erase(channels);
+  if (!input0())
+    return;
+
+  const ChannelSet available = input0()->deepInfo().channels();
+  ChannelSet get_channels = channels;
+  get_channels &= available;
+  get_channels += Mask_Deep;
+  if (available.contains(Chan_Alpha))
+    get_channels += Mask_Alpha;
+
+  DeepPlane plane;
+  if (!input0()->deepEngine(y, x, r, get_channels, plane))
+    return;
+
+  // Output channels the input can supply, and where to write them:
+  std::vector<Channel> chans;
+  std::vector<float*> out;
+  foreach(z, channels) {
+    if (!available.contains(z) || z == Chan_DeepFront || z == Chan_DeepBack)
+      continue;
+    chans.push_back(z);
+    out.push_back(row.writable(z));
+  }
+  const int nChans = chans.size();
+  const bool hasAlpha = available.contains(Chan_Alpha);
+
+  std::vector<float> front, back;
+  std::vector<unsigned> order;
+  std::vector<float> acc(nChans + 1);
+  std::vector<float> value(nChans + 1);
+
+  for (int X = x; X < r; X++) {
+    if (aborted())
+      return;
+
+    DeepPixel pixel = plane.getPixel(y, X);
+    const unsigned nSamples = pixel.getSampleCount();
+    if (nSamples == 0)
+      continue;
+
+    front.resize(nSamples);
+    back.resize(nSamples);
+    order.resize(nSamples);
+    for (unsigned i = 0; i < nSamples; i++) {
+      front[i] = pixel.getUnorderedSample(i, Chan_DeepFront);
+      back[i] = pixel.getUnorderedSample(i, Chan_DeepBack);
+      order[i] = i;
+    }
+    // Rather than sorting every sample, heapify in O(n) and pop samples
+    // front to back only until the pixel is opaque:
+    const DepthGreater greater(&front[0], &back[0]);
+    std::make_heap(order.begin(), order.end(), greater);
+
+    std::fill(acc.begin(), acc.end(), 0.0f);
+    float accAlpha = 0.0f;
+
+    for (std::vector<unsigned>::iterator end = order.end(); end != order.begin(); --end) {
+      std::pop_heap(order.begin(), end, greater);
+      const unsigned i = *(end - 1);
+      for (int k = 0; k < nChans; k++)
+        value[k] = pixel.getUnorderedSample(i, chans[k]);
+
+      // over: acc += (1 - acc.alpha) * sample, for all channels at once
+      const float t = 1.0f - accAlpha;
+      float* a = &acc[0];
+      const float* v = &value[0];
+      for (int k = 0; k < nChans; k++)
+        a[k] += t * v[k];
+
+      if (!hasAlpha)
+        continue;
+      accAlpha += t * pixel.getUnorderedSample(i, Chan_Alpha);
+      if (accAlpha >= _opaque)
+        break;
+    }
+
+    for (int k = 0; k < nChans; k++)
+      out[k][X] = acc[k];
+  }
+}
+
+static Op* build(Node* node) { return new DeepFlatten(node); }
+const Op::Description DeepFlatten::d(RCLASS, "Image/DeepFlatten", build);
@@ -0,0 +1,121 @@
+//
+//  DeepHalf.h
+//
+//  Float <-> half conversion for compact storage of deep samples. Uses the
+//  F16C instructions when the compiler targets them (-mf16c, which the
+//  Makefile passes for DeepDiskCache), otherwise a portable bit-twiddling
+//  version with the same round-to-nearest-even result.
+//
+
+#ifndef DEEP_HALF_H
+#define DEEP_HALF_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifdef __F16C__
+#include <immintrin.h>
+#endif
+
+namespace DeepHalf {
+
+/* Convert one float to half, rounding to nearest even. Values too large for
+   a half become infinity, NaNs stay NaNs. */
+inline uint16_t fromFloat(float value)
+{
+  uint32_t f;
+  memcpy(&f, &value, sizeof(f));
+  const uint32_t sign = (f >> 16) & 0x8000u;
+  const uint32_t absf = f & 0x7fffffffu;
+
+  if (absf >= 0x7f800000u)  // inf or NaN
+    return uint16_t(sign | 0x7c00u | (absf > 0x7f800000u ? 0x200u | ((absf >> 13) & 0x3ffu) : 0u));
+  if (absf >= 0x477ff000u)  // rounds past the largest half
+    return uint16_t(sign | 0x7c00u);
+
+  if (absf < 0x38800000u) {
+    // denormal half (or zero): shift the mantissa, with its implicit bit,
+    // into place and round
+    if (absf < 0x33000000u)
+      return uint16_t(sign);
+    const uint32_t shift = 113 - (absf >> 23);
+    const uint32_t mant = (absf & 0x7fffffu) | 0x800000u;
+    uint32_t h = mant >> (shift + 13);
+    const uint32_t rest = mant & ((1u << (shift + 13)) - 1);
+    const uint32_t halfway = 1u << (shift + 12);
+    if (rest > halfway || (rest == halfway && (h & 1u)))
+      h++;
+    return uint16_t(sign | h);
+  }
+
+  // normal half: rebias the exponent and round the mantissa; a carry out of
+  // the mantissa correctly bumps the exponent
+  uint32_t h = (absf - 0x38000000u) >> 13;
+  const uint32_t rest = absf & 0x1fffu;
+  if (rest > 0x1000u || (rest == 0x1000u && (h & 1u)))
+    h++;
+  return uint16_t(sign | h);
+}
+
+/* Convert one half to float. Exact, apart from NaNs being made quiet. */
+inline float toFloat(uint16_t half)
+{
+  const uint32_t sign = uint32_t(half & 0x8000u) << 16;
+  const uint32_t exp = (half >> 10) & 0x1fu;
+  uint32_t mant = half & 0x3ffu;
+  uint32_t f;
+
+  if (exp == 0x1fu) {
+    f = sign | 0x7f800000u | (mant << 13) | (mant ? 0x400000u : 0u);  // NaNs come back quiet
+  }
+  else if (exp != 0) {
+    f = sign | ((exp + 112) << 23) | (mant << 13);
+  }
+  else if (mant == 0) {
+    f = sign;
+  }
+  else {
+    // denormal half: normalise into a float
+    uint32_t e = 113;
+    while (!(mant & 0x400u)) {
+      mant <<= 1;
+      e--;
+    }
+    f = sign | (e << 23) | ((mant & 0x3ffu) << 13);
+  }
+
+  float value;
+  memcpy(&value, &f, sizeof(value));
+  return value;
+}
+
+/* Convert count floats to halves. */
+inline void fromFloats(const float* src, uint16_t* dst, size_t count)
+{
+  size_t i = 0;
+#ifdef __F16C__
+  for (; i + 4 <= count; i += 4) {
+    const __m128i h = _mm_cvtps_ph(_mm_loadu_ps(src + i), 0);  // 0 = round to nearest even
+    _mm_storel_epi64((__m128i*)(dst + i), h);
+  }
+#endif
+  for (; i < count; i++)
+    dst[i] = fromFloat(src[i]);
+}
+
+/* Convert count halves to floats. */
+inline void toFloats(const uint16_t* src, float* dst, size_t count)
+{
+  size_t i = 0;
+#ifdef __F16C__
+  for (; i + 4 <= count; i += 4)
+    _mm_storeu_ps(dst + i, _mm_cvtph_ps(_mm_loadl_epi64((const __m128i*)(src + i))));
+#endif
+  for (; i < count; i++)
+    dst[i] = toFloat(src[i]);
+}
+
+} // namespace DeepHalf
+
+#endif // DEEP_HALF_H
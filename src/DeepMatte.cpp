@@ -0,0 +1,332 @@
+//
+//  DeepMatte.cpp
+//  DeepMatte Node for Nuke
+//
+//  Pulls mattes or holdouts for a list of object/material IDs from a deep ID channel.
+//
+
+static const char* const RCLASS = "DeepMatte";
+
+static const char* const HELP = "Select deep samples by the ID stored in a channel.\n"
+                                "IDs are a list of numbers and ranges, e.g. '3 7 10-20'.\n"
+                                "matte: write the alpha of the selected samples into the matte channel, "
+                                "so flattening gives the visible coverage of the selected objects\n"
+                                "holdout: black out the colour of the selected samples, keeping their alpha "
+                                "so they still occlude what is behind them";
+
+#include "DDImage/Knobs.h"
+#include "DDImage/DeepOp.h"
+#include "DDImage/DeepFilterOp.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+#include <vector>
+#include <algorithm>
+
+using namespace DD::Image;
+
+enum { OUTPUT_MATTE, OUTPUT_HOLDOUT };
+static const char* const outputs[] = { "matte", "holdout", 0 };
+
+// Largest span of IDs looked up with a bit table (2MB); wider sets use a
+// binary search over the sorted ranges.
+#define MAX_BITSET_SPAN (1 << 24)
+
+// Largest float below 2^31, so any float up to it converts to an int safely
+#define MAX_INT_FLOAT 2147483520.0f
+
+class DeepMatte : public DeepFilterOp
+{
+  Channel _idChannel;
+  const char* _idText;
+  int _output;
+  Channel _matteChannel;
+  bool _invert;
+
+  // built in _validate:
+  std::vector<int> _rangeStart;     // sorted, non-overlapping inclusive ranges
+  std::vector<int> _rangeEnd;
+  float _idLo, _idHi;               // IDs outside this can't be in the set
+  int _setMin;                      // bit table covers [_setMin, _setMin + _setSpan)
+  unsigned _setSpan;
+  std::vector<uint32_t> _setBits;
+
+public:
+  void _validate(bool);
+  DeepMatte(Node* node) : DeepFilterOp(node)
+  {
+    _idChannel = Chan_Black;
+    _idText = "";
+    _output = OUTPUT_MATTE;
+    _matteChannel = Chan_Mask;
+    _invert = false;
+    _idLo = _idHi = 0.0f;
+    _setMin = 0;
+    _setSpan = 0;
+  }
+  virtual Op* default_input(int idx) const
+  {
+    return NULL;
+  }
+  DeepOp* input0() {
+      return dynamic_cast<DeepOp*>(Op::input(0));
+  }
+  const char* node_shape() const
+  {
+    return DeepOp::DeepNodeShape();
+  }
+
+  /*virtual*/
+  void getDeepRequests(Box bbox, const DD::Image::ChannelSet& channels, int count, std::vector<RequestData>& requests) {
+      if (!input0())
+          return;
+      requests.push_back(RequestData(input0(), bbox, inputChannels(channels), count));
+  }
+
+  ChannelSet inputChannels(const ChannelSet& channels)
+  {
+    ChannelSet get_channels = channels;
+    if (_output == OUTPUT_MATTE)
+      get_channels -= _matteChannel;
+    get_channels += _idChannel;
+    get_channels += Mask_Alpha;
+    get_channels &= input0()->deepInfo().channels();
+    return get_channels;
+  }
+
+  bool parseIds(const char* text, std::vector<std::pair<int, int> >& ranges);
+  void match(const float* ids, float* out, size_t count) const;
+
+  virtual bool doDeepEngine(Box box, const ChannelSet& channels, DeepOutputPlane& outPlane);
+  virtual void knobs(Knob_Callback);
+  const char* Class() const { return RCLASS; }
+  const char* node_help() const { return HELP; }
+  static Iop::Description d;
+};
+
+/* Parse a list like "3, 7 10-20" into inclusive ranges. */
+bool DeepMatte::parseIds(const char* text, std::vector<std::pair<int, int> >& ranges)
+{
+  const char* p = text ? text : "";
+  while (*p) {
+    if (*p == ' ' || *p == ',' || *p == '\t' || *p == '\n') {
+      p++;
+      continue;
+    }
+
+    char* end;
+    const long first = strtol(p, &end, 10);
+    if (end == p) {
+      error("Could not read the IDs at '%s'", p);
+      return false;
+    }
+    long last = first;
+    p = end;
+    if (*p == '-') {
+      last = strtol(p + 1, &end, 10);
+      if (end == p + 1) {
+        error("Incomplete ID range at '%s'", p);
+        return false;
+      }
+      p = end;
+    }
+    const long lo = MAX(MIN(first, last), long(INT_MIN));
+    const long hi = MIN(MAX(first, last), long(INT_MAX));
+    if (lo <= hi)
+      ranges.push_back(std::make_pair(int(lo), int(hi)));
+  }
+  return true;
+}
+
+/* Build the lookup structures from the ID list: the ranges are sorted and
+   merged, and if they fit a bit table is filled so each test is one load. */
+void DeepMatte::_validate(bool for_real)
+{
+  DeepFilterOp::_validate(for_real);
+
+  std::vector<std::pair<int, int> > ranges;
+  _rangeStart.clear();
+  _rangeEnd.clear();
+  _setBits.clear();
+  _setSpan = 0;
+
+  if (parseIds(_idText, ranges) && !ranges.empty()) {
+    std::sort(ranges.begin(), ranges.end());
+    for (size_t i = 0; i < ranges.size(); i++) {
+      // touching or overlapping the previous range; written so nothing
+      // overflows at INT_MIN or INT_MAX
+      if (!_rangeEnd.empty() && (ranges[i].first == INT_MIN || ranges[i].first - 1 <= _rangeEnd.back())) {
+        _rangeEnd.back() = MAX(_rangeEnd.back(), ranges[i].second);
+        continue;
+      }
+      _rangeStart.push_back(ranges[i].first);
+      _rangeEnd.push_back(ranges[i].second);
+    }
+
+    _idLo = float(_rangeStart.front());
+    _idHi = MIN(float(_rangeEnd.back()), MAX_INT_FLOAT);
+
+    const double span = double(_rangeEnd.back()) - double(_rangeStart.front()) + 1.0;
+    if (span <= MAX_BITSET_SPAN) {
+      _setMin = _rangeStart.front();
+      _setSpan = unsigned(span);
+      _setBits.assign((_setSpan + 31) / 32 + 1, 0);
+      for (size_t r = 0; r < _rangeStart.size(); r++) {
+        const unsigned last = unsigned(_rangeEnd[r] - _setMin);
+        for (unsigned bit = unsigned(_rangeStart[r] - _setMin); bit <= last; bit++)
+          _setBits[bit >> 5] |= 1u << (bit & 31);
+      }
+    }
+  }
+
+  if (_output == OUTPUT_MATTE && _matteChannel != Chan_Black) {
+    ChannelSet out_channels = _deepInfo.channels();
+    out_channels += _matteChannel;
+    _deepInfo = DeepInfo(_deepInfo.formats(), _deepInfo.box(), out_channels);
+  }
+}
+
+/* out[i] = 1 if ids[i] is in the set, else 0 (reversed when inverted).
+   IDs are rounded to the nearest integer. NaN, infinite and out of range
+   IDs are outside the set, and are swapped for a safe value before being
+   converted to int. */
+void DeepMatte::match(const float* ids, float* out, size_t count) const
+{
+  const float hit = _invert ? 0.0f : 1.0f;
+  const float miss = 1.0f - hit;
+
+  if (_rangeStart.empty()) {
+    for (size_t i = 0; i < count; i++)
+      out[i] = miss;
+    return;
+  }
+
+  const float lo = _idLo, hi = _idHi;
+
+  if (_setSpan) {
+    // Out of range IDs are redirected to bit 0 and masked off, so the loop
+    // has no branches:
+    const uint32_t* bits = &_setBits[0];
+    for (size_t i = 0; i < count; i++) {
+      const float r = floorf(ids[i] + 0.5f);
+      const unsigned valid = r >= lo && r <= hi;
+      const unsigned idx = unsigned(int(valid ? r : lo) - _setMin);
+      const unsigned inside = (idx < _setSpan) & valid;
+      const unsigned safe = idx * inside;
+      const unsigned set = (bits[safe >> 5] >> (safe & 31)) & inside;
+      out[i] = set ? hit : miss;
+    }
+    return;
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    const float v = floorf(ids[i] + 0.5f);
+    if (!(v >= lo && v <= hi)) {
+      out[i] = miss;
+      continue;
+    }
+    const int id = int(v);
+    const size_t r = std::upper_bound(_rangeStart.begin(), _rangeStart.end(), id) - _rangeStart.begin();
+    out[i] = (r > 0 && id <= _rangeEnd[r - 1]) ? hit : miss;
+  }
+}
+
+bool DeepMatte::doDeepEngine(Box box, const ChannelSet& channels, DeepOutputPlane& outPlane)
+{
+  if (!input0())
+    return true;
+
+  DeepPlane inPlane;
+  ChannelSet get_channels = inputChannels(channels);
+  if (!input0()->deepEngine(box, get_channels, inPlane))
+    return false;
+
+  outPlane = DeepOutputPlane(channels, box);
+
+  const bool hasId = get_channels.contains(_idChannel);
+  const bool hasAlpha = get_channels.contains(Chan_Alpha);
+
+  // Per output channel: what the selection does to it. In matte mode the
+  // matte channel becomes alpha * selected, in holdout mode the RGB channels
+  // become value * (1 - selected). Everything else, including aux channels
+  // like P and N, is copied.
+  enum { COPY, MATTE, HOLDOUT, ZERO };
+  const int nOutputChans = channels.size();
+  std::vector<Channel> chans;
+  std::vector<int> role;
+  foreach(z, channels) {
+    int r = get_channels.contains(z) ? COPY : ZERO;
+    if (_output == OUTPUT_MATTE && z == _matteChannel)
+      r = MATTE;
+    else if (_output == OUTPUT_HOLDOUT && r == COPY && z != _idChannel &&
+             (z == Chan_Red || z == Chan_Green || z == Chan_Blue))
+      r = HOLDOUT;
+    chans.push_back(z);
+    role.push_back(r);
+  }
+
+  std::vector<float> ids;
+  std::vector<float> selected;
+
+  for (Box::iterator it = box.begin(); it != box.end(); it++) {
+    if (Op::aborted())
+      return false;
+
+    DeepPixel in_pixel = inPlane.getPixel(it);
+    const unsigned nSamples = in_pixel.getSampleCount();
+
+    ids.resize(nSamples + 1);
+    selected.resize(nSamples + 1);
+    for (unsigned i = 0; i < nSamples; i++)
+      ids[i] = hasId ? in_pixel.getUnorderedSample(i, _idChannel) : 0.0f;
+    match(&ids[0], &selected[0], nSamples);
+
+    DeepOutPixel out_pixel;
+    out_pixel.reserve(nSamples * nOutputChans);
+
+    for (unsigned i = 0; i < nSamples; i++) {
+      const float s = selected[i];
+      const float alpha = hasAlpha ? in_pixel.getUnorderedSample(i, Chan_Alpha) : 1.0f;
+      for (int k = 0; k < nOutputChans; k++) {
+        switch (role[k]) {
+          case COPY:
+            out_pixel.push_back(in_pixel.getUnorderedSample(i, chans[k]));
+            break;
+          case MATTE:
+            out_pixel.push_back(alpha * s);
+            break;
+          case HOLDOUT:
+            out_pixel.push_back(in_pixel.getUnorderedSample(i, chans[k]) * (1.0f - s));
+            break;
+          default:
+            out_pixel.push_back(0.0f);
+            break;
+        }
+      }
+    }
+
+    outPlane.addPixel(out_pixel);
+  }
+
+  return true;
+}
+
+void DeepMatte::knobs(Knob_Callback f)
+{
+  Input_Channel_knob(f, &_idChannel, 1, 0, "id_channel", "id channel");
+  Tooltip(f, "The channel holding the per-sample object or material ID");
+  String_knob(f, &_idText, "ids", "ids");
+  Tooltip(f, "IDs to select: numbers and ranges separated by spaces or commas, e.g. '3 7 10-20'");
+  Bool_knob(f, &_invert, "invert");
+  Tooltip(f, "Select every sample whose ID is not in the list");
+  Enumeration_knob(f, &_output, outputs, "output");
+  Tooltip(f, "matte: write the selected samples' alpha into the matte channel\n"
+             "holdout: black out the colour of the selected samples, keeping their alpha");
+  Channel_knob(f, &_matteChannel, 1, "matte_channel", "matte channel");
+  Tooltip(f, "The channel the matte is written to in matte mode");
+}
+
+static Op* build(Node* node) { return new DeepMatte(node); }
+Op::Description DeepMatte::d(RCLASS, "Image/DeepMatte", build);
@@ -8,26 +8,74 @@
 
 #include "DDImage/Knobs.h"
 #include "DDImage/DeepOp.h"
-#include "DDImage/DeepPixelOp.h"
 #include "DDImage/DeepFilterOp.h"
 #include "DDImage/LookupCurves.h"
 
+#include "DeepTileIndex.h"
+#include "DeepTileArrays.h"
+
+#include <math.h>
+#include <vector>
+#include <algorithm>
+#include <limits>
+
 using namespace DD::Image;
 
 static const char* const RCLASS = "DeepOpacity";
 static const char* const HELP = "Adjust the opacity (alpha) per deep sample.";
 static const CurveDescription   lookupCurvesDefaults[]  = { { "master", "y C 1 1" }, {0} }; // FIND OUT HOW TO SET A DEFAULT FLAT CURVE @ 1
 
-class DeepOpacity : public DeepPixelOp
+#define MIN_LUT_SIZE 2
+#define MAX_LUT_SIZE 65536
+#define MAX_SAMPLE_SPLITS 64
+
+// change in slope per table entry that counts as a knot, as a fraction of
+// the range of curve values in the table
+static const float KNOT_TOLERANCE = 1e-4f;
+
+class DeepOpacity : public DeepFilterOp
 {
   // operates on Alpha channel only
   LookupCurves _lookupCurvesKnob;
 
+  // The curve is baked into _lut in _validate so the engine never has to
+  // evaluate the animation curve per sample.
+  int _lutSize;
+  float _lutRange[2]; // depth range covered by the table
+  bool _lutLog;       // space the table entries logarithmically in depth
+
+  std::vector<float> _lut;
+  float _lutMin, _lutMax;     // table domain, in depth (or log depth) units
+  float _lutScale;            // table entries per domain unit
+  bool _lutIsLog;             // table was baked in log depth
+  std::vector<float> _lutDepth;     // depth of each table entry
+  std::vector<float> _lutIntegral;  // running integral of the curve over depth
+  std::vector<float> _knots;        // depths where the curve bends, sorted
+  float _unitBelow;           // the curve is 1 from the table's near end to this depth
+  float _unitAbove;           // the curve is 1 from this depth to the table's far end
+
+  DeepTileIndex _tileIndex;
+
+  bool _volumetric;     // integrate the curve over [DeepFront, DeepBack]
+  bool _splitAtKnots;   // split volumetric samples where the curve bends
+
 public:
 
-  DeepOpacity(Node* node) : DeepPixelOp(node),
+  DeepOpacity(Node* node) : DeepFilterOp(node),
   _lookupCurvesKnob(lookupCurvesDefaults)
   {
+    _lutSize = 1024;
+    _lutRange[0] = 0.0f;
+    _lutRange[1] = 1000.0f;
+    _lutLog = false;
+    _lutMin = 0.0f;
+    _lutMax = 1.0f;
+    _lutScale = 1.0f;
+    _lutIsLog = false;
+    _unitBelow = -std::numeric_limits<float>::infinity();
+    _unitAbove = std::numeric_limits<float>::infinity();
+    _volumetric = false;
+    _splitAtKnots = false;
   }
 
   virtual Op* default_input(int idx) const
@@ -42,21 +90,28 @@ public:
     return DeepOp::DeepNodeShape();
   }
 
-  // /*virtual*/
+  /*virtual*/
   void getDeepRequests(Box bbox, const DD::Image::ChannelSet& channels, int count, std::vector<RequestData>& requests) 
   {
-      DeepPixelOp::getDeepRequests(bbox, channels, count, requests);
+      if (!input0())
+          return;
+      DD::Image::ChannelSet get_channels = channels;
+      get_channels += DeepTileIndex::channels();
+      requests.push_back(RequestData(input0(), bbox, get_channels, count));
   }
 
-  virtual bool doDeepEngine(Box box, const ChannelSet& channels, DeepOutputPlane& outPlane)
-  {
-    return DeepPixelOp::doDeepEngine(box, channels, outPlane);
-  }
+  virtual bool doDeepEngine(Box box, const ChannelSet& channels, DeepOutputPlane& outPlane);
 
   void _validate(bool);
-  float lookup(int z, float value) const;
+  void bakeLookup();
+  bool unitTile(const DeepTileSummary& summary) const;
+  float curve(float depth) const { return float(_lookupCurvesKnob.getValue(0, depth)); }
+  void lookup(const float* depth, float* out, size_t count) const;
+  float integral(float depth) const;
+  void volumeLookup(const float* front, const float* back, float* out, size_t count) const;
+  void splitSample(const DeepPixel& in_pixel, unsigned sample, const std::vector<Channel>& chans,
+                   const std::vector<float>& scaled, DeepOutPixel& out_pixel) const;
   virtual void knobs(Knob_Callback);
-  virtual void processSample(int y, int x, const DeepPixel& deepPixel, size_t sampleNo, const ChannelSet& channels, DeepOutPixel& output) const;
   const char* Class() const { return RCLASS; }
   const char* node_help() const { return HELP; }
   static Iop::Description d;
@@ -65,34 +120,366 @@ public:
 void DeepOpacity::_validate(bool for_real)
 {
   DeepFilterOp::_validate(for_real);
+  bakeLookup();
+}
+
+/* Sample the master curve into _lut across the depth range. With log
+   spacing the table is uniform in log(depth), which keeps resolution near
+   camera where most of the detail usually is. */
+void DeepOpacity::bakeLookup()
+{
+  const int size = MIN(MAX(_lutSize, MIN_LUT_SIZE), MAX_LUT_SIZE);
+  float zNear = MIN(_lutRange[0], _lutRange[1]);
+  float zFar = MAX(_lutRange[0], _lutRange[1]);
+
+  const bool useLog = _lutLog && zFar > 0.0f;
+  if (useLog) {
+    // log spacing needs a positive near value
+    zNear = MAX(zNear, zFar * 1e-6f);
+    _lutMin = logf(zNear);
+    _lutMax = logf(zFar);
+  }
+  else {
+    _lutMin = zNear;
+    _lutMax = zFar;
+  }
+
+  const float span = _lutMax - _lutMin;
+  _lutScale = span > 0.0f ? float(size - 1) / span : 0.0f;
+
+  _lut.resize(size);
+  _lutDepth.resize(size);
+  for (int i = 0; i < size; i++) {
+    float d = _lutMin + (span * i) / float(size - 1);
+    if (useLog)
+      d = expf(d);
+    _lutDepth[i] = d;
+    _lut[i] = float(_lookupCurvesKnob.getValue(0, d));
+  }
+  _lutIsLog = useLog;
+
+  // Trapezoid prefix sum so the integral between any two depths is O(1):
+  _lutIntegral.resize(size);
+  _lutIntegral[0] = 0.0f;
+  for (int i = 1; i < size; i++)
+    _lutIntegral[i] = _lutIntegral[i - 1] + 0.5f * (_lut[i - 1] + _lut[i]) * (_lutDepth[i] - _lutDepth[i - 1]);
+
+  // Knots are the table entries where the slope changes noticeably. The
+  // table doesn't know how the curve carries on past its ends, so the ends
+  // count too.
+  const float tolerance = KNOT_TOLERANCE * (*std::max_element(_lut.begin(), _lut.end()) -
+                                            *std::min_element(_lut.begin(), _lut.end()));
+  _knots.clear();
+  for (int i = 0; i < size; i++) {
+    const float prev = i > 0 ? _lut[i - 1] : _lut[i];
+    const float next = i < size - 1 ? _lut[i + 1] : _lut[i];
+    if (fabsf((next - _lut[i]) - (_lut[i] - prev)) > tolerance)
+      _knots.push_back(_lutDepth[i]);
+  }
+
+  // Depth ranges inside the table where the curve leaves samples untouched.
+  // Tiles entirely inside one are passed through without looking at their
+  // samples. Nothing is assumed about the curve outside the table.
+  const float inf = std::numeric_limits<float>::infinity();
+  int first = 0;
+  while (first < size && _lut[first] == 1.0f)
+    first++;
+  int last = size - 1;
+  while (last >= 0 && _lut[last] == 1.0f)
+    last--;
+
+  if (first == size) {
+    _unitBelow = _lutDepth[size - 1];
+    _unitAbove = _lutDepth[0];
+  }
+  else {
+    _unitBelow = first > 0 ? _lutDepth[first - 1] : -inf;
+    _unitAbove = last < size - 1 ? _lutDepth[last + 1] : inf;
+  }
+}
+
+/* True if every sample of a tile with this summary is left untouched. */
+bool DeepOpacity::unitTile(const DeepTileSummary& summary) const
+{
+  if (summary.empty())
+    return true;
+  return (summary.minFront >= _lutDepth.front() && summary.maxBack <= _unitBelow) ||
+         (summary.minFront >= _unitAbove && summary.maxBack <= _lutDepth.back());
+}
+
+/* Linearly interpolate the baked table for a run of depths. The loop has no
+   data-dependent branches so the compiler can vectorise it; depths outside
+   the table are then evaluated on the curve itself in a second pass. */
+void DeepOpacity::lookup(const float* depth, float* out, size_t count) const
+{
+  const float* z = depth;
+  const float* lut = &_lut[0];
+  const float last = float(_lut.size() - 1);
+  const float lutMin = _lutMin;
+  const float scale = _lutScale;
+
+  if (_lutIsLog) {
+    for (size_t i = 0; i < count; i++)
+      out[i] = logf(MAX(depth[i], 1e-30f));
+    depth = out;
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    float t = (depth[i] - lutMin) * scale;
+    t = MIN(MAX(t, 0.0f), last);
+    const int i0 = MIN(int(t), int(last) - 1);
+    const float f = t - float(i0);
+    out[i] = lut[i0] + (lut[i0 + 1] - lut[i0]) * f;
+  }
+
+  const float zNear = _lutDepth.front(), zFar = _lutDepth.back();
+  for (size_t i = 0; i < count; i++) {
+    if (z[i] < zNear || z[i] > zFar)
+      out[i] = curve(z[i]);
+  }
+}
+
+/* Integral of the curve from the near end of the table to depth. The curve
+   is treated as linear in depth between table entries, matching the prefix
+   sum built in bakeLookup, and between the table end and depth outside it,
+   which is exact for constant or linear curve extrapolation. */
+float DeepOpacity::integral(float depth) const
+{
+  const int last = int(_lut.size()) - 1;
+  if (depth <= _lutDepth[0])
+    return (depth - _lutDepth[0]) * 0.5f * (_lut[0] + curve(depth));
+  if (depth >= _lutDepth[last])
+    return _lutIntegral[last] + (depth - _lutDepth[last]) * 0.5f * (_lut[last] + curve(depth));
+
+  float t = ((_lutIsLog ? logf(depth) : depth) - _lutMin) * _lutScale;
+  int i0 = MIN(MAX(int(t), 0), last - 1);
+  // rounding in the log can land one entry out:
+  if (depth < _lutDepth[i0])
+    i0 = MAX(i0 - 1, 0);
+  else if (depth > _lutDepth[i0 + 1])
+    i0 = MIN(i0 + 1, last - 1);
+
+  const float w = _lutDepth[i0 + 1] - _lutDepth[i0];
+  const float dz = depth - _lutDepth[i0];
+  const float g = w > 0.0f ? dz / w : 0.0f;
+  return _lutIntegral[i0] + dz * (_lut[i0] + 0.5f * g * (_lut[i0 + 1] - _lut[i0]));
 }
 
-float DeepOpacity::lookup(int z, float value) const
+/* Scale factor for RGB and alpha of volumetric samples: the mean of the
+   curve over [front, back]. It is the same multiplier point mode applies,
+   averaged across the sample, so it tends to the point lookup as the
+   sample gets thinner and fades opaque samples like any other.
+   Zero-thickness samples use the point lookup at the front depth. */
+void DeepOpacity::volumeLookup(const float* front, const float* back, float* out, size_t count) const
 {
-  value = float(_lookupCurvesKnob.getValue(0, value));
-  return value;
+  lookup(front, out, count);
+
+  for (size_t i = 0; i < count; i++) {
+    const float thickness = back[i] - front[i];
+    if (thickness > 0.0f)
+      out[i] = (integral(back[i]) - integral(front[i])) / thickness;
+  }
+}
+
+/* Fraction of a uniform sample's alpha (and premultiplied colour) carried
+   by a piece covering share of its thickness, seen on its own. The pieces
+   composite back to the whole sample. */
+static inline float pieceWeight(float alpha, float share)
+{
+  if (alpha <= 0.0f)
+    return share;
+  return (1.0f - powf(MAX(1.0f - alpha, 0.0f), share)) / alpha;
+}
+
+/* Split one volumetric sample at every knot inside [front, back] and write
+   the pieces to out_pixel. Each piece gets the share of the sample's alpha
+   its thickness accounts for, then is scaled by the mean curve value over
+   the piece, as volumeLookup does for a whole sample. RGB keeps the
+   sample's unpremultiplied colour. */
+void DeepOpacity::splitSample(const DeepPixel& in_pixel, unsigned sample, const std::vector<Channel>& chans,
+                              const std::vector<float>& scaled, DeepOutPixel& out_pixel) const
+{
+  const float front = in_pixel.getUnorderedSample(sample, Chan_DeepFront);
+  const float back = in_pixel.getUnorderedSample(sample, Chan_DeepBack);
+  const float alpha = in_pixel.getUnorderedSample(sample, Chan_Alpha);
+  const float thickness = back - front;
+  const int nOutputChans = chans.size();
+
+  std::vector<float>::const_iterator k = std::upper_bound(_knots.begin(), _knots.end(), front);
+  std::vector<float>::const_iterator kEnd = std::lower_bound(k, _knots.end(), back);
+  if (kEnd - k > MAX_SAMPLE_SPLITS - 1)
+    kEnd = k + (MAX_SAMPLE_SPLITS - 1);
+
+  float z0 = front;
+  float f0 = integral(front);
+  for (;;) {
+    const float z1 = k != kEnd ? *k : back;
+    const float f1 = integral(z1);
+    const float len = z1 - z0;
+    const float mean = len > 0.0f ? (f1 - f0) / len : 0.0f;
+    const float share = len / thickness;
+
+    const float factor = mean * pieceWeight(alpha, share);
+    const float d = factor - 1.0f;
+    for (int c = 0; c < nOutputChans; c++) {
+      if (chans[c] == Chan_DeepFront)
+        out_pixel.push_back(z0);
+      else if (chans[c] == Chan_DeepBack)
+        out_pixel.push_back(z1);
+      else
+        out_pixel.push_back(in_pixel.getUnorderedSample(sample, chans[c]) * (1.0f + scaled[c] * d));
+    }
+
+    if (k == kEnd)
+      break;
+    z0 = z1;
+    f0 = f1;
+    ++k;
+  }
 }
 
-void DeepOpacity::processSample(int y, int x, const DeepPixel& deepPixel, size_t sampleNo, const ChannelSet& channels, DeepOutPixel& output) const {
+/* Process a tile as one array per channel: the curve is looked up for every
+   sample of the tile in one batch, then RGB and alpha are scaled by it.
+   Scaling premultiplied RGB by the curve is the same as unpremultiplying,
+   scaling alpha and premultiplying again, without the divide. Pixels and
+   samples the curve leaves at 1 are copied through untouched. */
+bool DeepOpacity::doDeepEngine(Box box, const ChannelSet& channels, DeepOutputPlane& outPlane)
+{
+  if (!input0())
+    return true;
+
+  // Whole tiles where the curve is 1 are passed straight through. A tile
+  // the index hasn't seen is summarised from the plane fetched below.
+  const bool indexed = _unitBelow >= _lutDepth.front() || _unitAbove <= _lutDepth.back();
+  DeepTileSummary summary;
+  const bool known = indexed && _tileIndex.find(input0(), box, summary);
+  if (known && unitTile(summary))
+    return input0()->deepEngine(box, channels, outPlane);
+
+  DeepPlane inPlane;
+  ChannelSet get_channels = channels;
+  get_channels += Mask_DeepFront;
+  get_channels += Mask_Alpha;
+  if (_volumetric)
+    get_channels += Mask_DeepBack;
+  if (indexed && !known)
+    get_channels += DeepTileIndex::channels();
+
+  if (!input0()->deepEngine(box, get_channels, inPlane))
+    return false;
+
+  if (indexed && !known) {
+    _tileIndex.add(input0(), box, inPlane, summary);
+    if (unitTile(summary)) {
+      outPlane = DeepOutputPlane(channels, box);
+      for (Box::iterator it = box.begin(); it != box.end(); it++)
+        outPlane.addPixel(inPlane.getPixel(it));
+      return true;
+    }
+  }
+
+  DeepTileArrays tile;
+  tile.load(inPlane, box, get_channels);
+  const size_t total = tile.samples();
 
-  float orig_alpha = deepPixel.getUnorderedSample(sampleNo, Chan_Alpha);
-  float deep_val = deepPixel.getUnorderedSample(sampleNo, Chan_DeepFront);
-  float curve_val = lookup(0, deep_val);
-  float mod_alpha = orig_alpha * curve_val;
+  if (Op::aborted())
+    return false;
 
+  // Resolve the channel layout once for the tile:
+  const int nOutputChans = channels.size();
+  std::vector<Channel> chans;
+  std::vector<float> scaled; // 1 for channels the curve applies to, else 0
+  chans.reserve(nOutputChans);
+  scaled.reserve(nOutputChans);
   foreach(z, channels) {
-    if (z == Chan_Red || z == Chan_Green || z == Chan_Blue){
-      float unpremult_val = deepPixel.getUnorderedSample(sampleNo, z) / orig_alpha;
-      float new_val = unpremult_val * mod_alpha;
-      output.push_back(new_val);
+    chans.push_back(z);
+    scaled.push_back((z == Chan_Red || z == Chan_Green || z == Chan_Blue || z == Chan_Alpha) ? 1.0f : 0.0f);
+  }
+
+  const float* depth = tile.channel(Chan_DeepFront);
+  const float* back = tile.channel(Chan_DeepBack);
+  std::vector<float> factor(total + 1);  // curve value for each sample
+  if (_volumetric)
+    volumeLookup(depth, back, &factor[0], total);
+  else
+    lookup(depth, &factor[0], total);
+
+  // Number of pieces each sample splits into, from the knots inside it:
+  std::vector<unsigned> pieces;
+  const bool split = _volumetric && _splitAtKnots;
+  if (split) {
+    const std::vector<float>& knots = _knots;
+    pieces.resize(total + 1);
+    for (size_t i = 0; i < total; i++) {
+      std::vector<float>::const_iterator k = std::upper_bound(knots.begin(), knots.end(), depth[i]);
+      std::vector<float>::const_iterator kEnd = std::lower_bound(k, knots.end(), back[i]);
+      pieces[i] = 1 + MIN(unsigned(kEnd - k), unsigned(MAX_SAMPLE_SPLITS - 1));
     }
-    else if (z == Chan_Alpha) {
-      output.push_back(mod_alpha);
+  }
+
+  // Scale RGB and alpha in place. Pixels copied through and split samples
+  // read the input plane, so they still see the original values.
+  for (int k = 0; k < nOutputChans; k++) {
+    float* values = scaled[k] != 0.0f ? tile.channel(chans[k]) : NULL;
+    if (!values)
+      continue;
+    const float* c = &factor[0];
+    for (size_t i = 0; i < total; i++)
+      values[i] *= c[i];
+  }
+
+  std::vector<const float*> cols;
+  tile.columns(channels, cols);
+
+  outPlane = DeepOutputPlane(channels, box);
+
+  size_t p = 0;
+  for (Box::iterator it = box.begin(); it != box.end(); it++, p++) {
+    if (Op::aborted())
+      return false;
+
+    const size_t first = tile.first(p);
+    const unsigned nSamples = tile.count(p);
+
+    unsigned nChanged = 0;
+    unsigned nPieces = nSamples;
+    for (unsigned i = 0; i < nSamples; i++)
+      nChanged += (factor[first + i] != 1.0f);
+    if (split) {
+      nPieces = 0;
+      for (unsigned i = 0; i < nSamples; i++)
+        nPieces += pieces[first + i];
     }
-    else {
-      output.push_back(deepPixel.getUnorderedSample(sampleNo, z));
+
+    if (nChanged == 0 && nPieces == nSamples) {
+      outPlane.addPixel(inPlane.getPixel(it));
+      continue;
+    }
+
+    DeepOutPixel out_pixel;
+    out_pixel.reserve(nPieces * nOutputChans);
+
+    if (nPieces == nSamples) {
+      tile.getPixel(p, cols, out_pixel);
+      outPlane.addPixel(out_pixel);
+      continue;
+    }
+
+    DeepPixel in_pixel = inPlane.getPixel(it);
+    for (unsigned i = 0; i < nSamples; i++) {
+      const size_t s = first + i;
+      if (pieces[s] > 1) {
+        splitSample(in_pixel, i, chans, scaled, out_pixel);
+        continue;
+      }
+      for (int k = 0; k < nOutputChans; k++)
+        out_pixel.push_back(cols[k][s]);
     }
+
+    outPlane.addPixel(out_pixel);
   }
+
+  return true;
 }
 
 static const char* const enums[] = {
@@ -104,6 +491,26 @@ void DeepOpacity::knobs(Knob_Callback f)
 {
   Obsolete_knob(f, "action", "knob operation $value");
   LookupCurves_knob(f, &_lookupCurvesKnob, "LookupCurves_knob"); 
+
+  Divider(f);
+  Int_knob(f, &_lutSize, "lut_size", "lut size");
+  Tooltip(f, "Number of entries the curve is sampled into before processing. "
+             "Higher values follow sharp curves more closely.");
+  Float_knob(f, &_lutRange[0], "lut_near", "lut range");
+  ClearFlags(f, Knob::SLIDER);
+  Tooltip(f, "Nearest deep value covered by the lookup table. Nearer samples evaluate the curve directly, which is slower.");
+  Float_knob(f, &_lutRange[1], "lut_far", "");
+  ClearFlags(f, Knob::SLIDER | Knob::STARTLINE);
+  Tooltip(f, "Furthest deep value covered by the lookup table. Further samples evaluate the curve directly, which is slower.");
+  Bool_knob(f, &_lutLog, "lut_log", "log spacing");
+  Tooltip(f, "Space the lookup table logarithmically in depth, giving more resolution near camera.");
+
+  Bool_knob(f, &_volumetric, "volumetric", "volumetric");
+  SetFlags(f, Knob::STARTLINE);
+  Tooltip(f, "Average the curve over each sample's front to back depth range instead of reading it at the front, "
+             "so thick volumetric samples fade correctly across curve transitions.");
+  Bool_knob(f, &_splitAtKnots, "split_at_knots", "split at knots");
+  Tooltip(f, "In volumetric mode, split samples where the curve bends so each piece gets its own opacity.");
 }
 
 static Op* build(Node* node) { return new DeepOpacity(node); }
@@ -1,56 +1,242 @@
-#include "DDImage/DeepPixelOp.h"
+#include "DDImage/DeepFilterOp.h"
 // #include "DDImage/DeepOp.h"
 #include "DDImage/Knobs.h"
-#include "DDImage/RGB.h"
+
+#include "DeepSampleOrder.h"
+
+#include <math.h>
+#include <vector>
+#include <algorithm>
 
 static const char* CLASS = "DeepPlus";
 
 using namespace DD::Image;
 
-class DeepPlus : public DeepPixelOp
+class DeepPlus : public DeepFilterOp
 {
+  bool _addCoincident;  // sum samples from A and B at the same depth
+  float _tolerance;     // depth difference still treated as coincident
+
 public:
-  DeepPlus(Node* node) : DeepPixelOp(node) {
+  DeepPlus(Node* node) : DeepFilterOp(node) {
+    _addCoincident = true;
+    _tolerance = 0.0f;
+  }
+
+  int minimum_inputs() const { return 2; }
+  int maximum_inputs() const { return 2; }
+
+  const char* input_label(int n, char*) const
+  {
+    switch (n) {
+      case 0: return "A";
+      case 1: return "B";
+      default: return "";
+    }
   }
 
   const char* node_help() const
   {
-    return "Merge two Deep channels as a plus operation";
+    return "Merge two Deep channels as a plus operation.\n"
+           "The samples of both inputs are merged into one depth-sorted list per pixel. "
+           "Samples from A and B at the same depth can be added together into a single sample.";
   }
 
   const char* Class() const {
     return CLASS;
   }
 
-  virtual void in_channels(int, ChannelSet& channels) const
+  virtual Op* op()
   {
-    if (channels & Mask_RGB)
-      channels += Mask_RGB;
+    return this;
   }
 
-  virtual void processSample(int y, int x, const DD::Image::DeepPixel& deepPixel, size_t sampleNo, const DD::Image::ChannelSet& channels, DeepOutPixel& output) const;
-};
+  const char* node_shape() const
+  {
+    return DeepOp::DeepNodeShape();
+  }
+
+  DeepOp* input1()
+  {
+    return dynamic_cast<DeepOp*>(Op::input(1));
+  }
+
+  void knobs(Knob_Callback f)
+  {
+    Bool_knob(f, &_addCoincident, "add_coincident", "add coincident samples");
+    Tooltip(f, "Add samples from A and B that have the same front and back depth into a single sample. "
+               "When off, both samples are kept.");
+    Float_knob(f, &_tolerance, "tolerance");
+    SetRange(f, 0, 1);
+    Tooltip(f, "Largest difference in front and back depth for two samples to count as coincident");
+  }
 
+  int knob_changed(DD::Image::Knob* k)
+  {
+    knob("tolerance")->enable(_addCoincident);
+    return 1;
+  }
 
-void DeepPlus::processSample(int y, int x, const DD::Image::DeepPixel& deepPixel, size_t sampleNo, const DD::Image::ChannelSet& channels, DeepOutPixel& output) const
+  void _validate(bool for_real)
   {
-    bool madeLuma = false;
-    float luma;
+    DeepFilterOp::_validate(for_real);
+
+    if (input1()) {
+      input1()->validate(for_real);
+      DeepInfo bInfo = input1()->deepInfo();
+
+      Box box = _deepInfo.box();
+      box.merge(bInfo.box());
+      ChannelSet out_channels = _deepInfo.channels();
+      out_channels += bInfo.channels();
+
+      _deepInfo = DeepInfo(_deepInfo.formats(), box, out_channels);
+    }
+  }
+
+  /*virtual*/
+  void getDeepRequests(Box bbox, const DD::Image::ChannelSet& channels, int count, std::vector<RequestData>& requests)
+  {
+    for (int n = 0; n < 2; n++) {
+      DeepOp* in = dynamic_cast<DeepOp*>(Op::input(n));
+      if (!in)
+        continue;
+      DD::Image::ChannelSet get_channels = channels;
+      get_channels &= in->deepInfo().channels();
+      get_channels += Mask_Deep;
+      requests.push_back(RequestData(in, bbox, get_channels, count));
+    }
+  }
+
+  bool doDeepEngine(DD::Image::Box box, const ChannelSet& channels, DeepOutputPlane& plane);
+};
+
+/* Linear merge of the depth-sorted samples of A and B for every pixel.
+   Each output sample is a pair of input samples; either side may be
+   missing. Channels an input lacks contribute zero. */
+bool DeepPlus::doDeepEngine(DD::Image::Box box, const ChannelSet& channels, DeepOutputPlane& plane)
+{
+  if (!input0())
+    return true;
+
+  // Nothing to merge with:
+  if (!input1())
+    return input0()->deepEngine(box, channels, plane);
+
+  DeepOp* in[2] = { input0(), input1() };
+  DeepPlane inPlane[2];
+  std::vector<bool> present[2];
+  bool complete[2] = { true, true }; // input supplies every output channel
+
+  const int nOutputChans = channels.size();
+
+  for (int n = 0; n < 2; n++) {
+    ChannelSet get_channels = channels;
+    get_channels &= in[n]->deepInfo().channels();
+    get_channels += Mask_Deep;
+
+    if (!in[n]->deepEngine(box, get_channels, inPlane[n]))
+      return false;
+
+    // which output channels this input can supply:
+    present[n].reserve(nOutputChans);
     foreach(z, channels) {
-      if (z == Chan_Red || z == Chan_Green || z==Chan_Blue) {
-        if (!madeLuma) {
-          luma = y_convert_rec709(deepPixel.getUnorderedSample(sampleNo, Chan_Red),
-                                  deepPixel.getUnorderedSample(sampleNo, Chan_Green),
-                                  deepPixel.getUnorderedSample(sampleNo, Chan_Blue));
-          madeLuma = true;
-        }
-
-        output.push_back(luma);
-      } else {
-        output.push_back(deepPixel.getUnorderedSample(sampleNo, z));
+      present[n].push_back(get_channels.contains(z));
+      complete[n] = complete[n] && present[n].back();
+    }
+  }
+
+  std::vector<Channel> chans;
+  std::vector<bool> isDepth;
+  chans.reserve(nOutputChans);
+  isDepth.reserve(nOutputChans);
+  foreach(z, channels) {
+    chans.push_back(z);
+    isDepth.push_back(z == Chan_DeepFront || z == Chan_DeepBack);
+  }
+
+  plane = DeepOutputPlane(channels, box);
+
+  DeepSampleOrder orderA(inPlane[0], box);
+  DeepSampleOrder orderB(inPlane[1], box);
+  std::vector<std::pair<int, int> > merged;
+
+  for (DD::Image::Box::iterator it = box.begin(); it != box.end(); it++) {
+    if (Op::aborted())
+      return false;
+
+    DeepPixel pixelA = inPlane[0].getPixel(it);
+    DeepPixel pixelB = inPlane[1].getPixel(it);
+    const unsigned nA = pixelA.getSampleCount();
+    const unsigned nB = pixelB.getSampleCount();
+
+    // Only one side has samples: nothing to merge.
+    if (nB == 0 && complete[0]) {
+      plane.addPixel(pixelA);
+      continue;
+    }
+    if (nA == 0 && complete[1]) {
+      plane.addPixel(pixelB);
+      continue;
+    }
+
+    const DeepSampleOrder::Samples sortedA = orderA.get(it);
+    const DeepSampleOrder::Samples sortedB = orderB.get(it);
+    const float* frontA = sortedA.front;
+    const float* backA = sortedA.back;
+    const float* frontB = sortedB.front;
+    const float* backB = sortedB.back;
+
+    // Merge the two sorted lists into pairs of (A sample, B sample), so the
+    // exact output size is known before any data is copied:
+    merged.clear();
+    merged.reserve(nA + nB);
+    unsigned a = 0, b = 0;
+    while (a < nA && b < nB) {
+      const unsigned ia = sortedA.order[a];
+      const unsigned ib = sortedB.order[b];
+      if (_addCoincident &&
+          fabsf(frontA[ia] - frontB[ib]) <= _tolerance &&
+          fabsf(backA[ia] - backB[ib]) <= _tolerance) {
+        merged.push_back(std::make_pair(int(ia), int(ib)));
+        a++;
+        b++;
+      }
+      else if (frontA[ia] < frontB[ib] || (frontA[ia] == frontB[ib] && backA[ia] <= backB[ib])) {
+        merged.push_back(std::make_pair(int(ia), -1));
+        a++;
+      }
+      else {
+        merged.push_back(std::make_pair(-1, int(ib)));
+        b++;
       }
     }
+    for (; a < nA; a++)
+      merged.push_back(std::make_pair(int(sortedA.order[a]), -1));
+    for (; b < nB; b++)
+      merged.push_back(std::make_pair(-1, int(sortedB.order[b])));
+
+    DeepOutPixel out_pixel;
+    out_pixel.reserve(merged.size() * nOutputChans);
+
+    for (size_t s = 0; s < merged.size(); s++) {
+      const int ia = merged[s].first;
+      const int ib = merged[s].second;
+      for (int k = 0; k < nOutputChans; k++) {
+        const float va = (ia >= 0 && present[0][k]) ? pixelA.getUnorderedSample(ia, chans[k]) : 0.0f;
+        const float vb = (ib >= 0 && present[1][k]) ? pixelB.getUnorderedSample(ib, chans[k]) : 0.0f;
+        if (isDepth[k])
+          out_pixel.push_back(ia >= 0 ? va : vb);
+        else
+          out_pixel.push_back(va + vb);
+      }
+    }
+
+    plane.addPixel(out_pixel);
   }
 
+  return true;
+}
+
 static Op* build(Node* node) { return new DeepPlus(node); }
 static const Op::Description d(CLASS, "Image/DeepPlus", build);
@@ -0,0 +1,89 @@
+//
+//  DeepSampleMerge.h
+//
+//  Helpers for deep ops that combine runs of depth-sorted samples into one.
+//
+
+#ifndef DEEP_SAMPLE_MERGE_H
+#define DEEP_SAMPLE_MERGE_H
+
+#include "DDImage/DeepPlane.h"
+#include "DDImage/ChannelSet.h"
+
+#include "DeepSampleOrder.h"
+
+#include <vector>
+
+namespace DeepSampleMerge {
+
+/* What happens to each channel when samples are merged. */
+enum Role {
+  ROLE_FRONT, //!< nearest DeepFront of the run
+  ROLE_BACK,  //!< furthest DeepBack of the run
+  ROLE_OVER,  //!< premultiplied, combined front to back with 'over'
+  ROLE_FIRST  //!< value of the front-most sample
+};
+
+/* Resolve the role of every channel in channels once per tile. */
+inline void channelRoles(const DD::Image::ChannelSet& channels, const DD::Image::ChannelSet& mergeChannels,
+                         std::vector<DD::Image::Channel>& chans, std::vector<int>& roles)
+{
+  chans.clear();
+  roles.clear();
+  foreach(z, channels) {
+    chans.push_back(z);
+    if (z == DD::Image::Chan_DeepFront)
+      roles.push_back(ROLE_FRONT);
+    else if (z == DD::Image::Chan_DeepBack)
+      roles.push_back(ROLE_BACK);
+    else if (mergeChannels.contains(z))
+      roles.push_back(ROLE_OVER);
+    else
+      roles.push_back(ROLE_FIRST);
+  }
+}
+
+/* Combine the count samples listed front to back in order into a single
+   sample appended to out. Because 'over' is associative, replacing a run
+   by its merged sample leaves the flattened pixel unchanged. acc is
+   scratch of at least chans.size() floats. */
+inline void mergeRun(const DD::Image::DeepPixel& pixel, const unsigned* order, unsigned count,
+                     const std::vector<DD::Image::Channel>& chans, const std::vector<int>& roles,
+                     bool hasAlpha, std::vector<float>& acc, DD::Image::DeepOutPixel& out)
+{
+  const int nChans = chans.size();
+  const unsigned first = order[0];
+
+  for (int k = 0; k < nChans; k++)
+    acc[k] = roles[k] == ROLE_OVER ? 0.0f : pixel.getUnorderedSample(first, chans[k]);
+
+  float front = pixel.getUnorderedSample(first, DD::Image::Chan_DeepFront);
+  float back = pixel.getUnorderedSample(first, DD::Image::Chan_DeepBack);
+  float accAlpha = 0.0f;
+
+  for (unsigned s = 0; s < count; s++) {
+    const unsigned i = order[s];
+    const float t = 1.0f - accAlpha;
+    for (int k = 0; k < nChans; k++) {
+      if (roles[k] == ROLE_OVER)
+        acc[k] += t * pixel.getUnorderedSample(i, chans[k]);
+    }
+    if (hasAlpha)
+      accAlpha += t * pixel.getUnorderedSample(i, DD::Image::Chan_Alpha);
+    front = MIN(front, pixel.getUnorderedSample(i, DD::Image::Chan_DeepFront));
+    back = MAX(back, pixel.getUnorderedSample(i, DD::Image::Chan_DeepBack));
+  }
+
+  for (int k = 0; k < nChans; k++) {
+    if (roles[k] == ROLE_FRONT)
+      out.push_back(front);
+    else if (roles[k] == ROLE_BACK)
+      out.push_back(back);
+    else
+      out.push_back(acc[k]);
+  }
+}
+
+} // namespace DeepSampleMerge
+
+#endif // DEEP_SAMPLE_MERGE_H
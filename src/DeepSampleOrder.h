@@ -0,0 +1,140 @@
+//
+//  DeepSampleOrder.h
+//
+//  Front to back sample order for the pixels of a deep plane, worked out once
+//  per pixel and shared by every ordered access in an engine call.
+//
+
+#ifndef DEEP_SAMPLE_ORDER_H
+#define DEEP_SAMPLE_ORDER_H
+
+#include "DDImage/DeepPlane.h"
+
+#include <vector>
+#include <algorithm>
+
+/* Orders sample indices front to back by DeepFront, then DeepBack. */
+struct DepthLess
+{
+  const float* front;
+  const float* back;
+  DepthLess(const float* f, const float* b) : front(f), back(b) {}
+  bool operator()(unsigned a, unsigned b) const
+  {
+    if (front[a] != front[b])
+      return front[a] < front[b];
+    return back[a] < back[b];
+  }
+};
+
+/* Orders sample indices back to front by DeepFront, then DeepBack, so a
+   heap built with it has the front-most sample on top. */
+struct DepthGreater
+{
+  const float* front;
+  const float* back;
+  DepthGreater(const float* f, const float* b) : front(f), back(b) {}
+  bool operator()(unsigned a, unsigned b) const
+  {
+    if (front[a] != front[b])
+      return front[a] > front[b];
+    return back[a] > back[b];
+  }
+};
+
+/* The samples of a plane's pixels in depth order. Each pixel is sorted the
+   first time it is asked for and kept for the life of the object, which is
+   meant to be one engine call, so it needs no locking. Renderers usually
+   write samples in depth order already, so nearly sorted pixels use an
+   insertion sort, which is linear on sorted input. */
+class DeepSampleOrder
+{
+public:
+  /* One pixel's samples. front and back are indexed by the input sample
+     index; order lists those indices front to back. */
+  struct Samples
+  {
+    unsigned count;
+    const unsigned* order;
+    const float* front;
+    const float* back;
+  };
+
+  DeepSampleOrder(const DD::Image::DeepPlane& plane, const DD::Image::Box& box) : _plane(plane), _box(box)
+  {
+    const int w = MAX(box.w(), 0), h = MAX(box.h(), 0);
+    _start.resize(size_t(w) * h + 1);
+    _start[0] = 0;
+    size_t p = 0;
+    for (DD::Image::Box::iterator it = box.begin(); it != box.end(); it++, p++)
+      _start[p + 1] = _start[p] + plane.getPixel(it).getSampleCount();
+    _done.assign(_start.size() - 1, 0);
+    _order.resize(_start.back() + 1);
+    _front.resize(_start.back() + 1);
+    _back.resize(_start.back() + 1);
+  }
+
+  /* The samples of pixel (x, y), which must be inside the box. */
+  Samples get(int x, int y)
+  {
+    const size_t p = size_t(y - _box.y()) * _box.w() + (x - _box.x());
+    const size_t first = _start[p];
+    Samples s;
+    s.count = unsigned(_start[p + 1] - first);
+    s.order = &_order[first];
+    s.front = &_front[first];
+    s.back = &_back[first];
+
+    if (!_done[p]) {
+      DD::Image::DeepPixel pixel = _plane.getPixel(y, x);
+      for (unsigned i = 0; i < s.count; i++) {
+        _front[first + i] = pixel.getUnorderedSample(i, DD::Image::Chan_DeepFront);
+        _back[first + i] = pixel.getUnorderedSample(i, DD::Image::Chan_DeepBack);
+      }
+      sort(&_front[first], &_back[first], &_order[first], s.count);
+      _done[p] = 1;
+    }
+    return s;
+  }
+
+  Samples get(const DD::Image::Box::iterator& it)
+  {
+    return get(it.x, it.y);
+  }
+
+  /* Fill order with 0..count-1 sorted front to back. Insertion sort is
+     tried first; if the input turns out to be far from sorted it gives up
+     after a linear number of moves and std::sort finishes the job. */
+  static void sort(const float* front, const float* back, unsigned* order, unsigned count)
+  {
+    for (unsigned i = 0; i < count; i++)
+      order[i] = i;
+
+    const DepthLess less(front, back);
+    size_t budget = 4 * size_t(count) + 16;
+    for (unsigned i = 1; i < count; i++) {
+      const unsigned v = order[i];
+      unsigned j = i;
+      for (; j > 0 && less(v, order[j - 1]); j--)
+        order[j] = order[j - 1];
+      order[j] = v;
+
+      budget -= MIN(budget, size_t(i - j));
+      if (budget == 0) {
+        std::sort(order, order + count, less);
+        return;
+      }
+    }
+  }
+
+private:
+  const DD::Image::DeepPlane& _plane;
+  DD::Image::Box _box;
+  std::vector<size_t> _start;   // first sample of each pixel, plus the total
+  std::vector<char> _done;      // pixel has been sorted
+  std::vector<unsigned> _order;
+  std::vector<float> _front;
+  std::vector<float> _back;
+};
+
+#endif // DEEP_SAMPLE_ORDER_H
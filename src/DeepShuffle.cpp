@@ -0,0 +1,185 @@
+//
+//  DeepShuffle.cpp
+//  DeepShuffle Node for Nuke
+//
+//  Copies, moves or renames channels of a deep image.
+//
+
+static const char* const RCLASS = "DeepShuffle";
+
+static const char* const HELP = "Copies up to four deep channels into other channels.\n"
+                                "Each in channel is copied to the out channel below it; an in of none writes "
+                                "zeros. With rename on, the in channels are removed afterwards, so the data "
+                                "moves rather than being copied. Deep front and back are never removed.";
+
+#include "DDImage/Knobs.h"
+#include "DDImage/DeepOp.h"
+#include "DDImage/DeepFilterOp.h"
+
+#include "DeepTileArrays.h"
+
+#include <vector>
+
+using namespace DD::Image;
+
+class DeepShuffle : public DeepFilterOp
+{
+  Channel _from[4];
+  Channel _to[4];
+  bool _rename;
+
+  // resolved in _validate:
+  std::vector<Channel> _source; // input channel each output channel is read from, by channel
+  bool _identity;               // output is the input, untouched
+
+public:
+  void _validate(bool);
+  DeepShuffle(Node* node) : DeepFilterOp(node)
+  {
+    for (int i = 0; i < 4; i++)
+      _from[i] = _to[i] = Chan_Black;
+    _rename = false;
+    _identity = true;
+  }
+  virtual Op* default_input(int idx) const
+  {
+    return NULL;
+  }
+  DeepOp* input0() {
+      return dynamic_cast<DeepOp*>(Op::input(0));
+  }
+  const char* node_shape() const
+  {
+    return DeepOp::DeepNodeShape();
+  }
+
+  /* The input channel output channel z is read from; Chan_Black for zeros. */
+  Channel source(Channel z) const
+  {
+    return size_t(z) < _source.size() ? _source[z] : z;
+  }
+
+  /* Channels needed from the input to produce channels. */
+  ChannelSet inputChannels(const ChannelSet& channels) const
+  {
+    ChannelSet get_channels = Mask_Deep;
+    foreach(z, channels) {
+      if (source(z) != Chan_Black)
+        get_channels += source(z);
+    }
+    return get_channels;
+  }
+
+  /*virtual*/
+  void getDeepRequests(Box bbox, const DD::Image::ChannelSet& channels, int count, std::vector<RequestData>& requests) {
+      if (!input0())
+          return;
+      requests.push_back(RequestData(input0(), bbox, _identity ? channels : inputChannels(channels), count));
+  }
+
+  virtual bool doDeepEngine(Box box, const ChannelSet& channels, DeepOutputPlane& outPlane);
+
+  virtual void knobs(Knob_Callback);
+  const char* Class() const { return RCLASS; }
+  const char* node_help() const { return HELP; }
+  static Iop::Description d;
+};
+
+/* Build the output channel -> input channel table once, so the engine only
+   has to look each output channel up. */
+void DeepShuffle::_validate(bool for_real)
+{
+  DeepFilterOp::_validate(for_real);
+  _source.clear();
+  _identity = true;
+  if (!input0())
+    return;
+
+  const ChannelSet in_channels = _deepInfo.channels();
+  ChannelSet out_channels = in_channels;
+  ChannelSet targets = Mask_None;
+
+  Channel last = Chan_Black;
+  foreach(z, in_channels)
+    last = MAX(last, z);
+  for (int i = 0; i < 4; i++)
+    last = MAX(last, _to[i]);
+  _source.resize(size_t(last) + 1);
+  for (size_t z = 0; z < _source.size(); z++)
+    _source[z] = Channel(z);
+
+  for (int i = 0; i < 4; i++) {
+    if (_to[i] == Chan_Black)
+      continue;
+    // a source the input doesn't have reads as zero:
+    _source[_to[i]] = in_channels.contains(_from[i]) ? _from[i] : Chan_Black;
+    targets += _to[i];
+    out_channels += _to[i];
+  }
+
+  if (_rename) {
+    for (int i = 0; i < 4; i++) {
+      if (_to[i] != Chan_Black && _from[i] != Chan_Black &&
+          !targets.contains(_from[i]) && _from[i] != Chan_DeepFront && _from[i] != Chan_DeepBack)
+        out_channels -= _from[i];
+    }
+  }
+
+  for (size_t z = 0; z < _source.size() && _identity; z++)
+    _identity = _source[z] == Channel(z);
+  _identity = _identity && out_channels == in_channels;
+
+  _deepInfo = DeepInfo(_deepInfo.formats(), _deepInfo.box(), out_channels);
+}
+
+/* Transpose the input tile to one array per channel, point each output
+   channel at its source array (or the zero array) and copy the columns back
+   out pixel by pixel. */
+bool DeepShuffle::doDeepEngine(Box box, const ChannelSet& channels, DeepOutputPlane& outPlane)
+{
+  if (!input0())
+    return true;
+
+  if (_identity)
+    return input0()->deepEngine(box, channels, outPlane);
+
+  DeepPlane inPlane;
+  const ChannelSet get_channels = inputChannels(channels);
+  if (!input0()->deepEngine(box, get_channels, inPlane))
+    return false;
+
+  DeepTileArrays tile;
+  tile.load(inPlane, box, get_channels);
+
+  std::vector<const float*> cols;
+  foreach(z, channels) {
+    const float* values = source(z) != Chan_Black ? tile.channel(source(z)) : NULL;
+    cols.push_back(values ? values : tile.zeros());
+  }
+
+  outPlane = DeepOutputPlane(channels, box);
+  const int nOutputChans = channels.size();
+  for (size_t p = 0; p < tile.pixels(); p++) {
+    if (Op::aborted())
+      return false;
+    DeepOutPixel out_pixel;
+    out_pixel.reserve(tile.count(p) * nOutputChans);
+    tile.getPixel(p, cols, out_pixel);
+    outPlane.addPixel(out_pixel);
+  }
+
+  return true;
+}
+
+void DeepShuffle::knobs(Knob_Callback f)
+{
+  Input_Channel_knob(f, _from, 4, 0, "in", "in");
+  Tooltip(f, "Channels to copy from. none writes zeros into the out channel.");
+  Channel_knob(f, _to, 4, "out", "out");
+  Tooltip(f, "Channels to copy into. Set an out channel to none to skip it.");
+  Bool_knob(f, &_rename, "rename", "rename");
+  Tooltip(f, "Remove the in channels once they are copied, unless they are also out channels.");
+}
+
+static Op* build(Node* node) { return new DeepShuffle(node); }
+Op::Description DeepShuffle::d(RCLASS, "Color/DeepShuffle", build);
@@ -0,0 +1,67 @@
+//
+//  DeepSpMask.h
+//
+//  Plain 64-bit access to OpenDCX 8x8 subpixel masks. The mask travels in two
+//  float channels holding its upper and lower 32 bits, as Dcx::SpMask8's
+//  fromFloat/toFloat do. Bit x + 8*y is subpixel (x, y).
+//
+
+#ifndef DEEP_SPMASK_H
+#define DEEP_SPMASK_H
+
+#include <stdint.h>
+#include <string.h>
+
+namespace DeepSpMask {
+
+static const uint64_t ALL = ~uint64_t(0);
+static const uint64_t COLUMN0 = 0x0101010101010101ull;
+
+/* The mask carried by a sample's two spmask floats. */
+inline uint64_t fromFloats(float sp1, float sp2)
+{
+  uint32_t hi, lo;
+  memcpy(&hi, &sp1, sizeof(hi));
+  memcpy(&lo, &sp2, sizeof(lo));
+  return (uint64_t(hi) << 32) | uint64_t(lo);
+}
+
+/* The two spmask floats that carry mask. */
+inline void toFloats(uint64_t mask, float& sp1, float& sp2)
+{
+  const uint32_t hi = uint32_t(mask >> 32);
+  const uint32_t lo = uint32_t(mask);
+  memcpy(&sp1, &hi, sizeof(sp1));
+  memcpy(&sp2, &lo, sizeof(sp2));
+}
+
+/* The subpixels a mask covers: a mask of 0 is a legacy sample covering the
+   whole pixel. No branch, so loops over masks vectorise. */
+inline uint64_t coverage(uint64_t mask)
+{
+  return mask | (uint64_t(0) - uint64_t(mask == 0));
+}
+
+/* Move a mask dx subpixels along x and dy along y. Subpixels moved off an
+   edge are dropped rather than wrapped. */
+inline uint64_t shift(uint64_t mask, int dx, int dy)
+{
+  if (dx >= 8 || dx <= -8 || dy >= 8 || dy <= -8)
+    return 0;
+
+  // columns that stay on the mask, as a byte, repeated for every row
+  if (dx > 0)
+    mask = (mask & (COLUMN0 * ((0xffu >> dx) & 0xffu))) << dx;
+  else if (dx < 0)
+    mask = (mask & (COLUMN0 * ((0xffu << -dx) & 0xffu))) >> -dx;
+
+  if (dy > 0)
+    mask <<= 8 * dy;
+  else if (dy < 0)
+    mask >>= 8 * -dy;
+  return mask;
+}
+
+} // namespace DeepSpMask
+
+#endif // DEEP_SPMASK_H
@@ -38,11 +38,15 @@
 #include <DDImage/DeepFilterOp.h>
 #include <DDImage/Knobs.h>
 #include <DDImage/Convolve.h>
+#include <DDImage/Thread.h>
 
 #include <OpenDCX/DcxDeepPixel.h>
 
 #include "DDImageAdapter.h" // for spmask nuke channel assignments
 
+#include "DeepSpMask.h"
+#include "DeepSampleOrder.h"
+
 
 using namespace DD::Image;
 
@@ -50,14 +54,62 @@ using namespace DD::Image;
 //  DeepSubpixelMask
 //
 //      An example Nuke plugin which displays a deep sample's subpixel mask pattern
-//      and allows it to be set.
+//      and allows it to be set, at one pixel or across a region.
 //      This plugin is intended primarily for debugging purposes.
 //
 
 //----------------------------------------------------------------------------------------
 
-enum { PATTERN_GET, PATTERN_SET };
-const char* const pattern_modes[] = { "get", "set", 0 };
+enum { PATTERN_GET, PATTERN_SET, PATTERN_REGION };
+const char* const pattern_modes[] = { "get", "set", "region", 0 };
+
+enum { REGION_REPLACE, REGION_SET, REGION_CLEAR, REGION_INVERT, REGION_SHIFT };
+const char* const region_ops[] = { "replace", "set", "clear", "invert", "shift", 0 };
+
+//----------------------------------------------------------------------------------------
+
+/*! One sample of the probed pixel, as shown in the knobs.
+*/
+struct ProbeSample {
+    float   Zf, Zb;
+    float   color[4];
+    float   sp[2];
+    float   flags;
+};
+
+/*! The probed pixel's samples and what they were fetched for. The samples
+    are stored in 'sample' knob order.
+*/
+struct Probe {
+    DD::Image::Hash         hash;           //!< Input hash
+    int                     x, y;           //!< Pixel
+    DD::Image::Channel      color_channel[4];
+    DD::Image::Channel      spmask_channel[2];
+    DD::Image::Channel      flags_channel;
+    std::vector<ProbeSample> samples;
+    bool                    has_spmask;
+    bool                    has_flags;
+    bool                    valid;
+
+    Probe() : x(0), y(0), has_spmask(false), has_flags(false), valid(false) {}
+
+    DD::Image::ChannelSet channels() const {
+        DD::Image::ChannelSet channels(Mask_Deep);
+        channels += spmask_channel[0];
+        channels += spmask_channel[1];
+        channels += flags_channel;
+        for (int c=0; c < 4; ++c)
+            channels += color_channel[c];
+        return channels;
+    }
+
+    bool sameKey(const Probe& b) const {
+        return valid && b.valid && hash == b.hash && x == b.x && y == b.y &&
+               memcmp(color_channel, b.color_channel, sizeof(color_channel)) == 0 &&
+               memcmp(spmask_channel, b.spmask_channel, sizeof(spmask_channel)) == 0 &&
+               flags_channel == b.flags_channel;
+    }
+};
 
 //----------------------------------------------------------------------------------------
 
@@ -71,6 +123,9 @@ class DeepSubpixelMask : public DeepFilterOp {
     DD::Image::Channel      k_flags_channel;        //!< Per-sample flags channel
     int                     k_mode;
     bool                    k_set_all_samples;      //!< In set mode apply pattern to all samples
+    float                   k_region[4];            //!< Region mode area
+    int                     k_region_op;            //!< What region mode does to each mask
+    int                     k_shift[2];             //!< Subpixels to shift masks by
     //
     int                     k_num_samples;          //!< Num samples for selected pixel
     ConvolveArray           k_spmask_pattern;       //!< For pattern knob
@@ -81,6 +136,10 @@ class DeepSubpixelMask : public DeepFilterOp {
     double                  k_color_sampled[4];     //!< Sampled color values
     //
     Dcx::DeepMetadata       m_dpmeta;               //!< Derived deep metadata (subpixel mask, flags)
+    //
+    DD::Image::Lock         m_probe_lock;
+    Probe                   m_probe;                //!< Last fetched pixel
+    Probe                   m_probe_fetching;       //!< Key of the fetch in progress
 
 public:
     static const Description description;
@@ -102,6 +161,10 @@ public:
         k_color_channel[3]  = Chan_Alpha;
         k_mode              = PATTERN_GET;
         k_set_all_samples   = false;
+        k_region[0]         = k_region[1] = 0.0f;
+        k_region[2]         = k_region[3] = 1.0f;
+        k_region_op         = REGION_REPLACE;
+        k_shift[0]          = k_shift[1] = 0;
         k_num_samples       = 0;
         k_spmask_pattern.width  = Dcx::SpMask8::width;
         k_spmask_pattern.height = Dcx::SpMask8::height;
@@ -114,14 +177,6 @@ public:
 
     /*virtual*/ Op* op() { return this; }
 
-    /*! Force knobs to update if the input changes in any way.
-    */
-    /*virtual*/
-    void append(Hash& hash) {
-        if (k_mode == PATTERN_GET && input0())
-            hash = input0()->op()->hash();
-    }
-
     /*virtual*/
     void knobs(Knob_Callback f) {
         XY_knob(f, k_pos, "pos");
@@ -140,9 +195,26 @@ public:
             SetFlags(f, Knob::EARLY_STORE);
         Bool_knob(f, &k_set_all_samples, "set_all_samples", "set all samples");
             ClearFlags(f, Knob::STARTLINE);
+        BBox_knob(f, k_region, "region");
+            Tooltip(f, "In region mode the masks of every sample in this area are changed.");
+        Enumeration_knob(f, &k_region_op, region_ops, "region_op", "region op");
+            Tooltip(f, "What region mode does to each sample's mask:\n"
+                       "replace: use the pattern\n"
+                       "set: turn on the pattern's bits\n"
+                       "clear: turn off the pattern's bits\n"
+                       "invert: flip the pattern's bits\n"
+                       "shift: move the mask by the shift amount, dropping bits moved off the edge\n"
+                       "Samples left with no bits on are removed.");
+        Int_knob(f, &k_shift[0], "shift_x", "shift");
+            SetRange(f, -7, 7);
+            Tooltip(f, "Subpixels to move masks along x in shift mode");
+        Int_knob(f, &k_shift[1], "shift_y", "");
+            SetRange(f, -7, 7);
+            ClearFlags(f, Knob::STARTLINE);
+            Tooltip(f, "Subpixels to move masks along y in shift mode");
         Divider(f);
         Int_knob(f, &k_sample, "sample", "do sample");
-            Tooltip(f, "Sample to get or set the subpixel mask on.");
+            Tooltip(f, "Sample to get or set the subpixel mask on, counting from the front (0 is the nearest).");
         Int_knob(f, &k_num_samples, "num_samples", " out of ");
             SetFlags(f, Knob::EARLY_STORE | Knob::NO_ANIMATION);
             ClearFlags(f, Knob::STARTLINE);
@@ -195,7 +267,12 @@ public:
         // Any change should force an update:
         bool sampled_pixel=false, sampled_spmask=false, sampled_flags=false;
         updateSampleKnobs(sampled_pixel, sampled_spmask, sampled_flags);
+        enableSampleKnobs(sampled_pixel, sampled_spmask, sampled_flags);
 
+        return 1; // make sure we get called again
+    }
+
+    void enableSampleKnobs(bool sampled_pixel, bool sampled_spmask, bool sampled_flags) {
         knob("num_samples")->enable(sampled_pixel);
         knob("Zf")->enable(sampled_pixel);
         knob("Zb")->enable(sampled_pixel);
@@ -208,9 +285,11 @@ public:
         knob("color2")->enable(sampled_pixel);
         knob("color3")->enable(sampled_pixel);
 #endif
-        knob("spmask")->enable(sampled_spmask || k_mode == PATTERN_SET);
-
-        return 1; // make sure we get called again
+        knob("spmask")->enable(sampled_spmask || k_mode != PATTERN_GET);
+        knob("region")->enable(k_mode == PATTERN_REGION);
+        knob("region_op")->enable(k_mode == PATTERN_REGION);
+        knob("shift_x")->enable(k_mode == PATTERN_REGION && k_region_op == REGION_SHIFT);
+        knob("shift_y")->enable(k_mode == PATTERN_REGION && k_region_op == REGION_SHIFT);
     }
 
     /*virtual*/
@@ -218,6 +297,7 @@ public:
         if (k_mode == PATTERN_GET) {
             bool sampled_pixel=false, sampled_spmask=false, sampled_flags=false;
             updateSampleKnobs(sampled_pixel, sampled_spmask, sampled_flags);
+            enableSampleKnobs(sampled_pixel, sampled_spmask, sampled_flags);
         }
         return true;
     }
@@ -226,7 +306,7 @@ public:
     void _validate(bool for_real) {
         DeepFilterOp::_validate(for_real);
 
-        if (k_mode == PATTERN_SET) {
+        if (k_mode != PATTERN_GET) {
             // Flip the float array vertically when filling in the spmask:
             m_dpmeta.spmask = Dcx::SpMask8(0x0);
             for (int sp_y=0; sp_y < Dcx::SpMask8::height; ++sp_y) {
@@ -240,7 +320,7 @@ public:
 
         // Output subpixel mask channels:
         DD::Image::ChannelSet out_channels(_deepInfo.channels());
-        if (k_mode == PATTERN_SET) {
+        if (k_mode != PATTERN_GET) {
             out_channels += k_spmask_channel[0];
             out_channels += k_spmask_channel[1];
         }
@@ -249,10 +329,12 @@ public:
     }
 
     /*! Expand the deep request to include the sample location and spmask/flag channels.
+        In set and region modes only pixels inside the request can change, so the box is left alone.
     */
     /*virtual*/
     void getDeepRequests(Box bbox, const DD::Image::ChannelSet& channels, int count, std::vector<RequestData>& requests) {
-        bbox.merge(int(k_pos[0]), int(k_pos[1]));
+        if (k_mode == PATTERN_GET)
+            bbox.merge(int(k_pos[0]), int(k_pos[1]));
         DD::Image::ChannelSet input_channels(channels);
         input_channels += Mask_Deep; // just in case...
         input_channels += k_spmask_channel[0];
@@ -265,32 +347,115 @@ public:
         DeepFilterOp::getDeepRequests(bbox, input_channels, count, requests);
     }
 
-    /*! Get the input deep samples for the selected pixel and copy or set
-        the data depending on the mode.
+    /*! The probe key for the current knobs: input hash, pixel and channels.
+        The input must have been validated so its hash is current.
     */
-    void updateSampleKnobs(bool& sampled_pixel, bool& sampled_spmask, bool& sampled_flags) {
-        sampled_pixel = sampled_spmask = sampled_flags = false;
-        if (!input0())
-           return; // need input!
+    Probe probeKey() {
+        Probe key;
+        key.hash = input0()->op()->hash();
+        key.x = int(k_pos[0]);
+        key.y = int(k_pos[1]);
+        for (int c=0; c < 4; ++c)
+            key.color_channel[c] = k_color_channel[c];
+        key.spmask_channel[0] = k_spmask_channel[0];
+        key.spmask_channel[1] = k_spmask_channel[1];
+        key.flags_channel = k_flags_channel;
+        key.valid = true;
+        return key;
+    }
 
-        const int sampleX = int(k_pos[0]);
-        const int sampleY = int(k_pos[1]);
+    /*! Refresh the cached probe from an engine thread if the knobs or the
+        input have changed since it was fetched. Only the first tile to see
+        a new key fetches the pixel; the panel keeps showing the old probe
+        until asapUpdate() has it pick up the new one in updateUI.
+    */
+    void refreshProbe() {
+        if (!panel_visible())
+            return;
+        Probe probe = probeKey();
+        {
+            Guard guard(m_probe_lock);
+            if (m_probe.sameKey(probe) || m_probe_fetching.sameKey(probe))
+                return;
+            m_probe_fetching = probe;
+        }
+
+        const bool fetched = fetchProbe(probe);
 
-        input0()->validate(true);
+        {
+            Guard guard(m_probe_lock);
+            if (fetched)
+                m_probe = probe;
+            m_probe_fetching.valid = false;
+        }
+        if (fetched)
+            asapUpdate();
+    }
+
+    /*! Fetch the samples of the probe pixel into probe. Called from the
+        engine, so the input is validated and the pixel has been requested.
+        Returns false if the fetch was aborted.
+    */
+    bool fetchProbe(Probe& probe) {
         DeepInfo deepInfo = input0()->deepInfo();
-        Box box(sampleX, sampleY, sampleX+1, sampleY+1);
+        DD::Image::ChannelSet get_channels(probe.channels());
+        get_channels &= deepInfo.channels();
 
-        DD::Image::ChannelSet get_channels(Mask_None);
-        if (deepInfo.channels().contains(Mask_Deep)          ) get_channels += Mask_Deep;
-        if (deepInfo.channels().contains(k_spmask_channel[0])) get_channels += k_spmask_channel[0];
-        if (deepInfo.channels().contains(k_spmask_channel[1])) get_channels += k_spmask_channel[1];
-        if (deepInfo.channels().contains(k_flags_channel    )) get_channels += k_flags_channel;
-        if (deepInfo.channels().contains(k_color_channel[0] )) get_channels += k_color_channel[0];
-        if (deepInfo.channels().contains(k_color_channel[1] )) get_channels += k_color_channel[1];
-        if (deepInfo.channels().contains(k_color_channel[2] )) get_channels += k_color_channel[2];
-        if (deepInfo.channels().contains(k_color_channel[3] )) get_channels += k_color_channel[3];
+        if (!get_channels.empty() &&
+            probe.x >= deepInfo.x() && probe.x < deepInfo.r() &&
+            probe.y >= deepInfo.y() && probe.y < deepInfo.t()) {
 
-        input0()->deepRequest(box, get_channels);
+            DD::Image::DeepPlane in_plane;
+            if (!input0()->deepEngine(probe.y, probe.x, probe.x+1, get_channels, in_plane))
+                return false;
+
+            DD::Image::DeepPixel in_pixel = in_plane.getPixel(probe.y, probe.x);
+            DeepSampleOrder sample_order(in_plane, Box(probe.x, probe.y, probe.x+1, probe.y+1));
+            const DeepSampleOrder::Samples sorted = sample_order.get(probe.x, probe.y);
+            const unsigned nSamples = sorted.count;
+            probe.has_spmask = get_channels.contains(probe.spmask_channel[0]) ||
+                               get_channels.contains(probe.spmask_channel[1]);
+            probe.has_flags  = get_channels.contains(probe.flags_channel);
+            probe.samples.resize(nSamples);
+            // Sample k is the k'th from the front:
+            for (unsigned k=0; k < nSamples; ++k) {
+                const unsigned i = sorted.order[k];
+                ProbeSample& s = probe.samples[k];
+                s.Zf = sorted.front[i];
+                s.Zb = sorted.back[i];
+                // Only channels the input has were fetched; the rest read as 0:
+                for (int c=0; c < 4; ++c)
+                    s.color[c] = get_channels.contains(probe.color_channel[c]) ?
+                                 in_pixel.getUnorderedSample(i, probe.color_channel[c]) : 0.0f;
+                s.sp[0] = (probe.has_spmask && get_channels.contains(probe.spmask_channel[0])) ?
+                          in_pixel.getUnorderedSample(i, probe.spmask_channel[0]) : 0.0f;
+                s.sp[1] = (probe.has_spmask && get_channels.contains(probe.spmask_channel[1])) ?
+                          in_pixel.getUnorderedSample(i, probe.spmask_channel[1]) : 0.0f;
+                s.flags = probe.has_flags ? in_pixel.getUnorderedSample(i, probe.flags_channel) : 0.0f;
+            }
+        }
+
+        return true;
+    }
+
+    /*! Get the last fetched probe. This never touches the input: the probe
+        is refreshed by the engine, so it can lag the knobs until the next
+        render through this op has finished.
+    */
+    void getProbe(Probe& probe) {
+        Guard guard(m_probe_lock);
+        probe = m_probe;
+    }
+
+    /*! Copy the cached input deep samples for the selected pixel into the
+        knobs.
+    */
+    void updateSampleKnobs(bool& sampled_pixel, bool& sampled_spmask, bool& sampled_flags) {
+        sampled_pixel = sampled_spmask = sampled_flags = false;
+
+        Probe probe;
+        if (input0())
+            getProbe(probe);
 
         k_num_samples = 0;
         k_Zf_sampled = k_Zb_sampled = 0.0;
@@ -299,56 +464,34 @@ public:
         std::string flags_str;
         memset(k_spmask_array, 0, Dcx::SpMask8::numBits*sizeof(float));
 
-        if (!get_channels.empty() &&
-            sampleX >= deepInfo.x() && sampleX < deepInfo.r() &&
-            sampleY >= deepInfo.y() && sampleY < deepInfo.t()) {
-
-            DD::Image::DeepPlane in_plane;
-            if (input0()->deepEngine(sampleY, sampleX, sampleX+1, get_channels, in_plane)) {
-
-                DD::Image::DeepPixel in_pixel = in_plane.getPixel(sampleY, sampleX);
-                k_num_samples = in_pixel.getSampleCount();
-                if (k_sample >= 0 && k_sample < k_num_samples) {
-                    const unsigned get_sample = k_num_samples - k_sample - 1;
-                    k_Zf_sampled = in_pixel.getOrderedSample(get_sample, Chan_DeepFront);
-                    k_Zb_sampled = in_pixel.getOrderedSample(get_sample, Chan_DeepBack);
-                    k_color_sampled[0] = in_pixel.getOrderedSample(get_sample, k_color_channel[0]);
-                    k_color_sampled[1] = in_pixel.getOrderedSample(get_sample, k_color_channel[1]);
-                    k_color_sampled[2] = in_pixel.getOrderedSample(get_sample, k_color_channel[2]);
-                    k_color_sampled[3] = in_pixel.getOrderedSample(get_sample, k_color_channel[3]);
-                    // Clip precision to 4 digits:
-                    k_Zf_sampled = rint(k_Zf_sampled * 10000.0)/10000.0;
-                    k_Zb_sampled = rint(k_Zb_sampled * 10000.0)/10000.0;
-                    k_color_sampled[0] = rint(k_color_sampled[0] * 10000.0)/10000.0;
-                    k_color_sampled[1] = rint(k_color_sampled[1] * 10000.0)/10000.0;
-                    k_color_sampled[2] = rint(k_color_sampled[2] * 10000.0)/10000.0;
-                    k_color_sampled[3] = rint(k_color_sampled[3] * 10000.0)/10000.0;
-
-                    if (k_mode == PATTERN_GET &&
-                        (deepInfo.channels().contains(k_spmask_channel[0]) ||
-                         deepInfo.channels().contains(k_spmask_channel[1]))) {
-                        // Convert floats to SpMask:
-                        const float sp1 = in_pixel.getOrderedSample(get_sample, k_spmask_channel[0]);
-                        const float sp2 = in_pixel.getOrderedSample(get_sample, k_spmask_channel[1]);
-                        m_dpmeta.spmask.fromFloat(sp1, sp2);
-                        // Convert to float array and update Array knob:
-                        for (int sp_y=0; sp_y < Dcx::SpMask8::height; ++sp_y) {
-                            Dcx::SpMask8 sp = (Dcx::SpMask8(0x01) << (sp_y*Dcx::SpMask8::width));
-                            for (int sp_x=0; sp_x < Dcx::SpMask8::width; ++sp_x, sp <<= 1)
-                                k_spmask_array[sp_x + (Dcx::SpMask8::height-sp_y-1)*Dcx::SpMask8::width] = (sp&m_dpmeta.spmask)?88.0f:0.0f;
-                        }
-                        sampled_spmask = true;
-                    }
-                    if (deepInfo.channels().contains(k_flags_channel)) {
-                        m_dpmeta.flags = (unsigned)floorf(in_pixel.getOrderedSample(get_sample, k_flags_channel));
-                        std::ostringstream oss;
-                        m_dpmeta.printFlags(oss);
-                        flags_str = oss.str();
-                        sampled_flags = true;
-                    }
-                    sampled_pixel = true;
+        k_num_samples = probe.samples.size();
+        if (k_sample >= 0 && k_sample < k_num_samples) {
+            const ProbeSample& s = probe.samples[k_sample];
+            // Clip precision to 4 digits:
+            k_Zf_sampled = rint(s.Zf * 10000.0)/10000.0;
+            k_Zb_sampled = rint(s.Zb * 10000.0)/10000.0;
+            for (int c=0; c < 4; ++c)
+                k_color_sampled[c] = rint(s.color[c] * 10000.0)/10000.0;
+
+            if (k_mode == PATTERN_GET && probe.has_spmask) {
+                // Convert floats to SpMask:
+                m_dpmeta.spmask.fromFloat(s.sp[0], s.sp[1]);
+                // Convert to float array and update Array knob:
+                for (int sp_y=0; sp_y < Dcx::SpMask8::height; ++sp_y) {
+                    Dcx::SpMask8 sp = (Dcx::SpMask8(0x01) << (sp_y*Dcx::SpMask8::width));
+                    for (int sp_x=0; sp_x < Dcx::SpMask8::width; ++sp_x, sp <<= 1)
+                        k_spmask_array[sp_x + (Dcx::SpMask8::height-sp_y-1)*Dcx::SpMask8::width] = (sp&m_dpmeta.spmask)?88.0f:0.0f;
                 }
+                sampled_spmask = true;
             }
+            if (probe.has_flags) {
+                m_dpmeta.flags = (unsigned)floorf(s.flags);
+                std::ostringstream oss;
+                m_dpmeta.printFlags(oss);
+                flags_str = oss.str();
+                sampled_flags = true;
+            }
+            sampled_pixel = true;
         }
         //
         Knob* ksamples = knob("num_samples"); assert(ksamples);
@@ -386,29 +529,45 @@ public:
         if (!input0())
             return true;
 
-        // We get the values during knob_changed/updateGUI, so we don't do
-        // anything special in engine - call the base class:
-        if (k_mode == PATTERN_GET)
+        const int sampleX = int(k_pos[0]);
+        const int sampleY = int(k_pos[1]);
+
+        // In get mode every request includes the probe pixel; otherwise only
+        // the tile holding it can fetch it:
+        if (k_mode == PATTERN_GET ||
+            (sampleX >= bbox.x() && sampleX < bbox.r() && sampleY >= bbox.y() && sampleY < bbox.t()))
+            refreshProbe();
+
+        if (k_mode == PATTERN_REGION)
+            return doRegionEngine(bbox, output_channels, deep_out_plane);
+
+        // The knobs are filled from the probe during knob_changed/updateUI,
+        // so we don't do anything special in engine - call the base class. In set mode the
+        // same goes for every tile that doesn't hold the target pixel:
+        if (k_mode == PATTERN_GET ||
+            sampleX < bbox.x() || sampleX >= bbox.r() || sampleY < bbox.y() || sampleY >= bbox.t())
             return input0()->deepEngine(bbox, output_channels, deep_out_plane);
 
         // Set the spmask:
+        DD::Image::ChannelSet input_channels(output_channels);
+        input_channels += Mask_Deep;
         DD::Image::DeepPlane deep_in_plane;
-        if (!input0()->deepEngine(bbox, output_channels, deep_in_plane))
+        if (!input0()->deepEngine(bbox, input_channels, deep_in_plane))
             return false;
 
         deep_out_plane = DD::Image::DeepOutputPlane(output_channels, bbox);
 
         const int nOutputChans = output_channels.size();
 
-        const int sampleX = int(k_pos[0]);
-        const int sampleY = int(k_pos[1]);
+        float sp1, sp2;
+        m_dpmeta.spmask.toFloat(sp1, sp2);
 
         for (Box::iterator it = bbox.begin(); it != bbox.end(); ++it) {
             if (Op::aborted())
                 return false; // bail fast on user-interrupt
 
-            // Get the deep pixel from the input:
-            if (k_mode == PATTERN_SET && (it.x != sampleX || it.y != sampleY)) {
+            // Every other pixel is copied straight from the input:
+            if (it.x != sampleX || it.y != sampleY) {
                 deep_out_plane.addPixel(deep_in_plane.getPixel(it));
                 continue;
             }
@@ -416,13 +575,18 @@ public:
             DD::Image::DeepPixel in_pixel = deep_in_plane.getPixel(it);
             const int nSamples = in_pixel.getSampleCount();
 
+            // The sample knob counts from the front, as in get mode:
+            int target = -1;
+            if (!k_set_all_samples && k_sample >= 0 && k_sample < nSamples) {
+                DeepSampleOrder sample_order(deep_in_plane, Box(sampleX, sampleY, sampleX+1, sampleY+1));
+                target = int(sample_order.get(sampleX, sampleY).order[k_sample]);
+            }
+
             DD::Image::DeepOutPixel out_pixel;
             out_pixel.reserve(nSamples*nOutputChans);
 
             for (int i=0; i < nSamples; ++i) {
-                if (k_set_all_samples || k_sample == i) {
-                    float sp1, sp2;
-                    m_dpmeta.spmask.toFloat(sp1, sp2);
+                if (k_set_all_samples || i == target) {
                     // Replace spmask channels:
                     foreach (z, output_channels) {
                         if (z == k_spmask_channel[0])
@@ -457,6 +621,116 @@ public:
         return true;
     }
 
+    /*! Apply the region op to count masks in place. Legacy masks of 0 are
+        treated as full coverage first. Clear, invert and shift can leave a
+        mask with no bits at all, which would read back as full coverage;
+        the caller drops those samples instead of writing the 0.
+    */
+    void applyRegionOp(uint64_t* masks, size_t count) const {
+        float sp1, sp2;
+        m_dpmeta.spmask.toFloat(sp1, sp2);
+        const uint64_t pattern = DeepSpMask::fromFloats(sp1, sp2);
+        switch (k_region_op) {
+            case REGION_REPLACE:
+                for (size_t i=0; i < count; ++i)
+                    masks[i] = pattern;
+                break;
+            case REGION_SET:
+                for (size_t i=0; i < count; ++i)
+                    masks[i] = DeepSpMask::coverage(masks[i]) | pattern;
+                break;
+            case REGION_CLEAR:
+                for (size_t i=0; i < count; ++i)
+                    masks[i] = DeepSpMask::coverage(masks[i]) & ~pattern;
+                break;
+            case REGION_INVERT:
+                for (size_t i=0; i < count; ++i)
+                    masks[i] = DeepSpMask::coverage(masks[i]) ^ pattern;
+                break;
+            case REGION_SHIFT:
+                for (size_t i=0; i < count; ++i)
+                    masks[i] = DeepSpMask::shift(DeepSpMask::coverage(masks[i]), k_shift[0], k_shift[1]);
+                break;
+        }
+    }
+
+    /*! Region mode: rewrite the spmask of every sample inside the region.
+        Each pixel's masks are gathered into 64-bit words, changed in one
+        loop and scattered back. Samples the op leaves covering no subpixels
+        are removed. Replacing with an empty pattern is the exception: as in
+        set mode, that writes the legacy full-coverage mask on purpose.
+        Tiles that miss the region pass through; Nuke already runs tiles on
+        all threads.
+    */
+    bool doRegionEngine(Box bbox, const DD::Image::ChannelSet& output_channels, DeepOutputPlane& deep_out_plane) {
+        Box region(int(floorf(k_region[0])), int(floorf(k_region[1])), int(ceilf(k_region[2])), int(ceilf(k_region[3])));
+        region.intersect(bbox);
+        if (region.x() >= region.r() || region.y() >= region.t())
+            return input0()->deepEngine(bbox, output_channels, deep_out_plane);
+
+        // The masks are read from the input whatever was asked for. A missing
+        // spmask channel reads as 0, so an input without them is all legacy
+        // full-coverage samples:
+        const DD::Image::ChannelSet& in_channels = input0()->deepInfo().channels();
+        const bool has_sp0 = in_channels.contains(k_spmask_channel[0]);
+        const bool has_sp1 = in_channels.contains(k_spmask_channel[1]);
+        DD::Image::ChannelSet input_channels(output_channels);
+        input_channels += Mask_Deep;
+        if (has_sp0)
+            input_channels += k_spmask_channel[0];
+        if (has_sp1)
+            input_channels += k_spmask_channel[1];
+
+        DD::Image::DeepPlane deep_in_plane;
+        if (!input0()->deepEngine(bbox, input_channels, deep_in_plane))
+            return false;
+
+        deep_out_plane = DD::Image::DeepOutputPlane(output_channels, bbox);
+
+        const int nOutputChans = output_channels.size();
+        const bool dropEmpty = k_region_op != REGION_REPLACE;
+        std::vector<uint64_t> masks;
+
+        for (Box::iterator it = bbox.begin(); it != bbox.end(); ++it) {
+            if (Op::aborted())
+                return false; // bail fast on user-interrupt
+
+            if (it.x < region.x() || it.x >= region.r() || it.y < region.y() || it.y >= region.t()) {
+                deep_out_plane.addPixel(deep_in_plane.getPixel(it));
+                continue;
+            }
+
+            DD::Image::DeepPixel in_pixel = deep_in_plane.getPixel(it);
+            const int nSamples = in_pixel.getSampleCount();
+
+            masks.resize(nSamples + 1);
+            for (int i=0; i < nSamples; ++i)
+                masks[i] = DeepSpMask::fromFloats(has_sp0 ? in_pixel.getUnorderedSample(i, k_spmask_channel[0]) : 0.0f,
+                                                  has_sp1 ? in_pixel.getUnorderedSample(i, k_spmask_channel[1]) : 0.0f);
+            applyRegionOp(&masks[0], nSamples);
+
+            DD::Image::DeepOutPixel out_pixel;
+            out_pixel.reserve(nSamples*nOutputChans);
+            for (int i=0; i < nSamples; ++i) {
+                if (dropEmpty && masks[i] == 0)
+                    continue; // no subpixels left
+                float sp1, sp2;
+                DeepSpMask::toFloats(masks[i], sp1, sp2);
+                foreach (z, output_channels) {
+                    if (z == k_spmask_channel[0])
+                        out_pixel.push_back(sp1);
+                    else if (z == k_spmask_channel[1])
+                        out_pixel.push_back(sp2);
+                    else
+                        out_pixel.push_back(in_pixel.getUnorderedSample(i, z));
+                }
+            }
+            deep_out_plane.addPixel(out_pixel);
+        }
+
+        return true;
+    }
+
 };
 
 static Op* build(Node* node) { return new DeepSubpixelMask(node); }
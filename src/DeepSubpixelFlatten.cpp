@@ -0,0 +1,240 @@
+//
+//  DeepSubpixelFlatten.cpp
+//  DeepSubpixelFlatten Node for Nuke
+//
+//  Flattens a deep stream per subpixel using the OpenDCX 8x8 subpixel masks.
+//
+
+static const char* const RCLASS = "DeepSubpixelFlatten";
+
+static const char* const HELP = "Flattens a deep image, compositing each of the 64 subpixels of an OpenDCX "
+                                "8x8 subpixel mask separately and averaging them, so samples that only "
+                                "partly cover a pixel give antialiased edges.\n"
+                                "Samples with no mask (both spmask channels 0) cover the whole pixel. "
+                                "Without spmask channels this gives the same result as DeepFlatten.";
+
+#include "DDImage/Iop.h"
+#include "DDImage/Row.h"
+#include "DDImage/Knobs.h"
+#include "DDImage/DeepOp.h"
+
+#include <OpenDCX/DcxDeepPixel.h>
+
+#include "DDImageAdapter.h" // for spmask nuke channel assignments
+
+#include "DeepSpMask.h"
+#include "DeepSampleOrder.h"
+
+#include <stdint.h>
+#include <vector>
+#include <algorithm>
+
+using namespace DD::Image;
+
+#define SUBPIXELS 64
+
+class DeepSubpixelFlatten : public Iop
+{
+  Channel _spmaskChannel[2];
+  float _opaque; // alpha at which a subpixel stops compositing
+
+public:
+  DeepSubpixelFlatten(Node* node) : Iop(node)
+  {
+    Channel flags;
+    Dcx::dcxGetSpmaskChannels(_spmaskChannel[0], _spmaskChannel[1], flags);
+    _opaque = 1.0f;
+  }
+
+  int minimum_inputs() const { return 1; }
+  int maximum_inputs() const { return 1; }
+
+  /*virtual*/
+  bool test_input(int idx, Op* op) const
+  {
+    return dynamic_cast<DeepOp*>(op) != NULL;
+  }
+
+  virtual Op* default_input(int idx) const
+  {
+    return NULL;
+  }
+
+  DeepOp* input0()
+  {
+    return dynamic_cast<DeepOp*>(Op::input(0));
+  }
+
+  void _validate(bool for_real)
+  {
+    if (!input0()) {
+      info_.set(Box());
+      set_out_channels(Mask_None);
+      return;
+    }
+
+    input0()->validate(for_real);
+    const DeepInfo& deepInfo = input0()->deepInfo();
+
+    ChannelSet channels = deepInfo.channels();
+    channels -= Mask_Deep;
+    channels -= _spmaskChannel[0];
+    channels -= _spmaskChannel[1];
+
+    info_.set(deepInfo.box());
+    info_.full_size_format(*deepInfo.fullSizeFormat());
+    info_.format(*deepInfo.format());
+    info_.channels(channels);
+    set_out_channels(Mask_All);
+  }
+
+  ChannelSet inputChannels(const ChannelSet& channels)
+  {
+    const ChannelSet available = input0()->deepInfo().channels();
+    ChannelSet get_channels = channels;
+    get_channels += Mask_Deep;
+    get_channels += Mask_Alpha;
+    get_channels += _spmaskChannel[0];
+    get_channels += _spmaskChannel[1];
+    get_channels &= available;
+    return get_channels;
+  }
+
+  void _request(int x, int y, int r, int t, ChannelMask channels, int count)
+  {
+    if (!input0())
+      return;
+    input0()->deepRequest(Box(x, y, r, t), inputChannels(channels), count);
+  }
+
+  void engine(int y, int x, int r, ChannelMask channels, Row& row);
+
+  void knobs(Knob_Callback f)
+  {
+    Input_Channel_knob(f, _spmaskChannel, 2, 0, "spmask_channels", "spmask channels");
+    Tooltip(f, "Channels which contain the per-sample spmask data. Two channels are required for an 8x8 mask.");
+    Float_knob(f, &_opaque, "opaque_threshold", "opaque threshold");
+    SetRange(f, 0.9, 1);
+    Tooltip(f, "Stop compositing a subpixel once its alpha reaches this value.");
+  }
+
+  const char* Class() const { return RCLASS; }
+  const char* node_help() const { return HELP; }
+  static const Iop::Description d;
+};
+
+/* Each pixel keeps an accumulator per subpixel, set up the first time a
+   sample touches it. Samples are popped front to back; each one is 'over'ed
+   into the subpixels of its mask that are not yet opaque, walking the set
+   bits with count-trailing-zeros. Untouched subpixels under an opaque sample
+   simply take its value, so they are counted with one popcount instead. */
+void DeepSubpixelFlatten::engine(int y, int x, int r, ChannelMask channels, Row& row)
+{
+  row.erase(channels);
+  if (!input0())
+    return;
+
+  const ChannelSet get_channels = inputChannels(channels);
+  DeepPlane plane;
+  if (!input0()->deepEngine(y, x, r, get_channels, plane))
+    return;
+
+  std::vector<Channel> chans;
+  std::vector<float*> out;
+  foreach(z, channels) {
+    if (!get_channels.contains(z) || z == Chan_DeepFront || z == Chan_DeepBack ||
+        z == _spmaskChannel[0] || z == _spmaskChannel[1])
+      continue;
+    chans.push_back(z);
+    out.push_back(row.writable(z));
+  }
+  const int nChans = chans.size();
+  const bool hasAlpha = get_channels.contains(Chan_Alpha);
+  const bool hasMask = get_channels.contains(_spmaskChannel[0]) && get_channels.contains(_spmaskChannel[1]);
+
+  std::vector<float> front, back;
+  std::vector<unsigned> order;
+  std::vector<float> sub(SUBPIXELS * nChans + 1);  // per subpixel accumulators
+  std::vector<float> subAlpha(SUBPIXELS);
+  std::vector<float> whole(nChans + 1);            // sum over the subpixels filled in one go
+  std::vector<float> value(nChans + 1);
+
+  for (int X = x; X < r; X++) {
+    if (aborted())
+      return;
+
+    DeepPixel pixel = plane.getPixel(y, X);
+    const unsigned nSamples = pixel.getSampleCount();
+    if (nSamples == 0)
+      continue;
+
+    front.resize(nSamples);
+    back.resize(nSamples);
+    order.resize(nSamples);
+    for (unsigned i = 0; i < nSamples; i++) {
+      front[i] = pixel.getUnorderedSample(i, Chan_DeepFront);
+      back[i] = pixel.getUnorderedSample(i, Chan_DeepBack);
+      order[i] = i;
+    }
+    const DepthGreater greater(&front[0], &back[0]);
+    std::make_heap(order.begin(), order.end(), greater);
+
+    uint64_t touched = 0;  // subpixels with an accumulator in sub
+    uint64_t opaque = 0;   // subpixels that take no more samples
+    std::fill(whole.begin(), whole.end(), 0.0f);
+
+    for (std::vector<unsigned>::iterator end = order.end(); end != order.begin() && opaque != DeepSpMask::ALL; --end) {
+      std::pop_heap(order.begin(), end, greater);
+      const unsigned i = *(end - 1);
+
+      uint64_t mask = hasMask ? DeepSpMask::fromFloats(pixel.getUnorderedSample(i, _spmaskChannel[0]),
+                                                       pixel.getUnorderedSample(i, _spmaskChannel[1])) : 0;
+      mask = DeepSpMask::coverage(mask) & ~opaque;
+      if (mask == 0)
+        continue;
+
+      for (int k = 0; k < nChans; k++)
+        value[k] = pixel.getUnorderedSample(i, chans[k]);
+      const float alpha = hasAlpha ? pixel.getUnorderedSample(i, Chan_Alpha) : 0.0f;
+
+      if (alpha >= _opaque) {
+        const uint64_t fresh = mask & ~touched;
+        if (fresh) {
+          const float n = float(__builtin_popcountll(fresh));
+          for (int k = 0; k < nChans; k++)
+            whole[k] += n * value[k];
+          opaque |= fresh;
+          mask &= ~fresh;
+        }
+      }
+
+      for (; mask; mask &= mask - 1) {
+        const int b = __builtin_ctzll(mask);
+        const uint64_t bit = uint64_t(1) << b;
+        float* acc = &sub[b * nChans];
+        if (!(touched & bit)) {
+          std::fill(acc, acc + nChans, 0.0f);
+          subAlpha[b] = 0.0f;
+          touched |= bit;
+        }
+        const float t = 1.0f - subAlpha[b];
+        for (int k = 0; k < nChans; k++)
+          acc[k] += t * value[k];
+        subAlpha[b] += t * alpha;
+        if (subAlpha[b] >= _opaque)
+          opaque |= bit;
+      }
+    }
+
+    for (uint64_t bits = touched; bits; bits &= bits - 1) {
+      const float* acc = &sub[__builtin_ctzll(bits) * nChans];
+      for (int k = 0; k < nChans; k++)
+        whole[k] += acc[k];
+    }
+    for (int k = 0; k < nChans; k++)
+      out[k][X] = whole[k] * (1.0f / SUBPIXELS);
+  }
+}
+
+static Op* build(Node* node) { return new DeepSubpixelFlatten(node); }
+const Op::Description DeepSubpixelFlatten::d(RCLASS, "Image/DeepSubpixelFlatten", build);
@@ -0,0 +1,126 @@
+//
+//  DeepTileArrays.h
+//
+//  A deep tile transposed into one contiguous array per channel, so kernels
+//  can run as plain loops over every sample of the tile instead of fetching
+//  one value at a time through DeepPixel.
+//
+
+#ifndef DEEP_TILE_ARRAYS_H
+#define DEEP_TILE_ARRAYS_H
+
+#include "DDImage/DeepPlane.h"
+#include "DDImage/ChannelSet.h"
+
+#include <vector>
+
+/* The samples of a tile, channel by channel. Pixels are numbered in
+   Box::iterator order; pixel p owns samples first(p) .. first(p + 1) - 1 of
+   every channel array, in the input's (unordered) sample order. */
+class DeepTileArrays
+{
+public:
+  DeepTileArrays() : _total(0) {}
+
+  /* Copy channels of every pixel of box out of plane. */
+  void load(const DD::Image::DeepPlane& plane, const DD::Image::Box& box, const DD::Image::ChannelSet& channels)
+  {
+    _box = box;
+    _chans.clear();
+    foreach(z, channels)
+      _chans.push_back(z);
+
+    const int w = MAX(box.w(), 0), h = MAX(box.h(), 0);
+    _start.resize(size_t(w) * h + 1);
+    _start[0] = 0;
+    size_t p = 0;
+    for (DD::Image::Box::iterator it = box.begin(); it != box.end(); it++, p++)
+      _start[p + 1] = _start[p] + plane.getPixel(it).getSampleCount();
+    _total = _start.back();
+    _data.resize(_chans.size() * _total + 1);
+    _zeros.assign(_total + 1, 0.0f);
+
+    p = 0;
+    for (DD::Image::Box::iterator it = box.begin(); it != box.end(); it++, p++) {
+      DD::Image::DeepPixel pixel = plane.getPixel(it);
+      const unsigned nSamples = unsigned(_start[p + 1] - _start[p]);
+      for (size_t c = 0; c < _chans.size(); c++) {
+        float* dst = &_data[c * _total + _start[p]];
+        for (unsigned i = 0; i < nSamples; i++)
+          dst[i] = pixel.getUnorderedSample(i, _chans[c]);
+      }
+    }
+  }
+
+  const DD::Image::Box& box() const { return _box; }
+  size_t pixels() const { return _start.size() - 1; }
+  size_t samples() const { return _total; }
+
+  /* Index of pixel p's first sample in the channel arrays, and its count. */
+  size_t first(size_t p) const { return _start[p]; }
+  unsigned count(size_t p) const { return unsigned(_start[p + 1] - _start[p]); }
+
+  /* The array of channel z, samples() long, or NULL if it wasn't loaded. */
+  float* channel(DD::Image::Channel z)
+  {
+    for (size_t c = 0; c < _chans.size(); c++) {
+      if (_chans[c] == z)
+        return &_data[c * _total];
+    }
+    return NULL;
+  }
+
+  const float* channel(DD::Image::Channel z) const
+  {
+    return const_cast<DeepTileArrays*>(this)->channel(z);
+  }
+
+  /* An array of samples() zeros, for channels that have no data. */
+  const float* zeros() const { return &_zeros[0]; }
+
+  /* Resolve the arrays to write for channels once per tile. Channels that
+     weren't loaded get zeros(), so writing needs no per-channel test. */
+  void columns(const DD::Image::ChannelSet& channels, std::vector<const float*>& cols) const
+  {
+    cols.clear();
+    foreach(z, channels) {
+      const float* values = channel(z);
+      cols.push_back(values ? values : zeros());
+    }
+  }
+
+  /* Interleave the samples of pixel p back into out, one value per column. */
+  void getPixel(size_t p, const std::vector<const float*>& cols, DD::Image::DeepOutPixel& out) const
+  {
+    const size_t begin = _start[p], end = _start[p + 1];
+    const size_t nCols = cols.size();
+    for (size_t s = begin; s < end; s++) {
+      for (size_t c = 0; c < nCols; c++)
+        out.push_back(cols[c][s]);
+    }
+  }
+
+  /* Write the whole tile to out as channels, which should have been made
+     for box(). */
+  void write(const DD::Image::ChannelSet& channels, DD::Image::DeepOutputPlane& out) const
+  {
+    std::vector<const float*> cols;
+    columns(channels, cols);
+    for (size_t p = 0; p < pixels(); p++) {
+      DD::Image::DeepOutPixel pixel;
+      pixel.reserve(count(p) * cols.size());
+      getPixel(p, cols, pixel);
+      out.addPixel(pixel);
+    }
+  }
+
+private:
+  DD::Image::Box _box;
+  std::vector<DD::Image::Channel> _chans;
+  std::vector<size_t> _start;   // first sample of each pixel, plus the total
+  size_t _total;
+  std::vector<float> _data;     // channel c at _data[c * _total]
+  std::vector<float> _zeros;
+};
+
+#endif // DEEP_TILE_ARRAYS_H
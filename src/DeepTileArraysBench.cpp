@@ -0,0 +1,184 @@
+//
+//  DeepTileArraysBench.cpp
+//
+//  Times a DeepOpacity-style kernel (scale RGBA by a factor worked out from
+//  each sample's depth) over a synthetic deep tile, once reading samples one
+//  at a time through DeepPixel and once through DeepTileArrays, and checks
+//  both give the same result. Build and run with 'make tilebench'.
+//
+
+#include "DDImage/DeepPlane.h"
+
+#include "DeepTileArrays.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <sys/time.h>
+#include <vector>
+#include <limits>
+
+using namespace DD::Image;
+
+// A tile the size of a few rows of a 2K deep render, with 0..MAX_SAMPLES
+// samples per pixel (MAX_SAMPLES / 2 on average)
+#define TILE_W 2048
+#define TILE_H 16
+#define MAX_SAMPLES 32
+#define RUNS 20
+
+static double now()
+{
+  timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+static float frand()
+{
+  return float(rand()) / float(RAND_MAX);
+}
+
+static inline float depthFactor(float depth)
+{
+  return 1.0f / (1.0f + 0.01f * depth);
+}
+
+static bool scaled(Channel z)
+{
+  return z == Chan_Red || z == Chan_Green || z == Chan_Blue || z == Chan_Alpha;
+}
+
+/* Fill plane with random samples, written in no particular depth order. */
+static size_t makeTile(const Box& box, const ChannelSet& channels, DeepOutputPlane& plane)
+{
+  size_t total = 0;
+  plane = DeepOutputPlane(channels, box);
+  for (Box::iterator it = box.begin(); it != box.end(); it++) {
+    const unsigned nSamples = unsigned(rand() % (MAX_SAMPLES + 1));
+    DeepOutPixel pixel;
+    pixel.reserve(nSamples * channels.size());
+    for (unsigned i = 0; i < nSamples; i++) {
+      const float front = 1000.0f * frand();
+      foreach(z, channels) {
+        if (z == Chan_DeepFront)
+          pixel.push_back(front);
+        else if (z == Chan_DeepBack)
+          pixel.push_back(front + frand());
+        else
+          pixel.push_back(frand());
+      }
+    }
+    plane.addPixel(pixel);
+    total += nSamples;
+  }
+  return total;
+}
+
+/* The kernel written the way the deep ops were before DeepTileArrays: one
+   getUnorderedSample call per value. */
+static void perSample(const DeepPlane& in, const Box& box, const ChannelSet& channels, DeepOutputPlane& out)
+{
+  out = DeepOutputPlane(channels, box);
+  for (Box::iterator it = box.begin(); it != box.end(); it++) {
+    DeepPixel pixel = in.getPixel(it);
+    const unsigned nSamples = pixel.getSampleCount();
+    DeepOutPixel out_pixel;
+    out_pixel.reserve(nSamples * channels.size());
+    for (unsigned i = 0; i < nSamples; i++) {
+      const float f = depthFactor(pixel.getUnorderedSample(i, Chan_DeepFront));
+      foreach(z, channels) {
+        const float v = pixel.getUnorderedSample(i, z);
+        out_pixel.push_back(scaled(z) ? v * f : v);
+      }
+    }
+    out.addPixel(out_pixel);
+  }
+}
+
+/* The same kernel on one array per channel. times gets the load, kernel and
+   write times added to it. */
+static void arrays(const DeepPlane& in, const Box& box, const ChannelSet& channels, DeepOutputPlane& out,
+                   double times[3])
+{
+  const double t0 = now();
+  DeepTileArrays tile;
+  tile.load(in, box, channels);
+  const size_t total = tile.samples();
+
+  const double t1 = now();
+  std::vector<float> factor(total + 1);
+  const float* depth = tile.channel(Chan_DeepFront);
+  for (size_t i = 0; i < total; i++)
+    factor[i] = depthFactor(depth[i]);
+  foreach(z, channels) {
+    if (!scaled(z))
+      continue;
+    float* values = tile.channel(z);
+    for (size_t i = 0; i < total; i++)
+      values[i] *= factor[i];
+  }
+
+  const double t2 = now();
+  out = DeepOutputPlane(channels, box);
+  tile.write(channels, out);
+  const double t3 = now();
+
+  times[0] += t1 - t0;
+  times[1] += t2 - t1;
+  times[2] += t3 - t2;
+}
+
+/* Largest difference between two planes of the same layout. */
+static float difference(const DeepPlane& a, const DeepPlane& b, const Box& box, const ChannelSet& channels)
+{
+  float worst = 0.0f;
+  for (Box::iterator it = box.begin(); it != box.end(); it++) {
+    DeepPixel pa = a.getPixel(it);
+    DeepPixel pb = b.getPixel(it);
+    if (pa.getSampleCount() != pb.getSampleCount())
+      return std::numeric_limits<float>::infinity();
+    for (unsigned i = 0; i < pa.getSampleCount(); i++) {
+      foreach(z, channels)
+        worst = MAX(worst, fabsf(pa.getUnorderedSample(i, z) - pb.getUnorderedSample(i, z)));
+    }
+  }
+  return worst;
+}
+
+int main()
+{
+  srand(1);
+  ChannelSet channels = Mask_RGBA;
+  channels += Mask_Deep;
+  const Box box(0, 0, TILE_W, TILE_H);
+
+  DeepOutputPlane in;
+  const size_t total = makeTile(box, channels, in);
+
+  DeepOutputPlane before, after;
+  double beforeTime = 0.0;
+  double afterTimes[3] = { 0.0, 0.0, 0.0 };
+  for (int run = 0; run < RUNS; run++) {
+    const double t0 = now();
+    perSample(in, box, channels, before);
+    beforeTime += now() - t0;
+    arrays(in, box, channels, after, afterTimes);
+  }
+
+  const double afterTime = afterTimes[0] + afterTimes[1] + afterTimes[2];
+  const double ms = 1000.0 / RUNS;
+  printf("tile %dx%d, %lu samples, %d channels, %d runs\n", TILE_W, TILE_H, (unsigned long)total,
+         int(channels.size()), RUNS);
+  printf("per sample:      %8.3f ms\n", beforeTime * ms);
+  printf("DeepTileArrays:  %8.3f ms (load %.3f, kernel %.3f, write %.3f)\n", afterTime * ms,
+         afterTimes[0] * ms, afterTimes[1] * ms, afterTimes[2] * ms);
+  printf("speedup:         %8.2fx\n", afterTime > 0.0 ? beforeTime / afterTime : 0.0);
+
+  const float worst = difference(before, after, box, channels);
+  if (!(worst <= 1e-6f)) {
+    printf("FAILED: results differ by %g\n", worst);
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,145 @@
+//
+//  DeepTileIndex.h
+//
+//  Per-tile depth summaries of a deep input, so ops can pass through or drop
+//  whole tiles without visiting their samples.
+//
+
+#ifndef DEEP_TILE_INDEX_H
+#define DEEP_TILE_INDEX_H
+
+#include "DDImage/DeepOp.h"
+#include "DDImage/DeepPlane.h"
+#include "DDImage/Thread.h"
+
+#include <map>
+
+// Tiles remembered per input before the index starts again
+#define DEEP_TILE_INDEX_SIZE 4096
+
+/* What is in one tile of a deep input. Deep samples always have
+   DeepFront <= DeepBack, so every sample lies within [minFront, maxBack]. */
+struct DeepTileSummary
+{
+  float minFront;
+  float maxBack;
+  unsigned maxSamples;  // most samples in any pixel; 0 for an empty tile
+  bool opaque;          // every pixel flattens to alpha 1
+
+  bool empty() const { return maxSamples == 0; }
+
+  /* All samples lie within [zNear, zFar]. */
+  bool within(float zNear, float zFar) const { return minFront >= zNear && maxBack <= zFar; }
+
+  /* No sample starts within [zNear, zFar]. */
+  bool clear(float zNear, float zFar) const { return maxBack < zNear || minFront > zFar; }
+};
+
+/* Summaries of the tiles an op has processed, kept until the input's hash
+   changes. The index never fetches tiles itself: an op looks a tile up with
+   find(), and on a miss fetches the tile as it would anyway, with
+   DeepTileIndex::channels() added, and hands the plane to add(). The next
+   visit to the tile can then skip the fetch. Ops hold one of these as a
+   member and should add DeepTileIndex::channels() to their deep requests. */
+class DeepTileIndex
+{
+  struct TileKey
+  {
+    int x, y, r, t;
+    TileKey(const DD::Image::Box& box) : x(box.x()), y(box.y()), r(box.r()), t(box.t()) {}
+    bool operator<(const TileKey& o) const
+    {
+      if (x != o.x) return x < o.x;
+      if (y != o.y) return y < o.y;
+      if (r != o.r) return r < o.r;
+      return t < o.t;
+    }
+  };
+  typedef std::map<TileKey, DeepTileSummary> TileMap;
+
+  DD::Image::Lock _lock;
+  DD::Image::Hash _hash;
+  TileMap _tiles;
+
+public:
+  /* Channels the summaries are computed from. */
+  static DD::Image::ChannelSet channels()
+  {
+    DD::Image::ChannelSet channels = DD::Image::Mask_Deep;
+    channels += DD::Image::Mask_Alpha;
+    return channels;
+  }
+
+  /* Summarise the pixels of box in plane. */
+  static void summarise(const DD::Image::DeepPlane& plane, const DD::Image::Box& box, bool hasAlpha,
+                        DeepTileSummary& summary)
+  {
+    summary.minFront = 0.0f;
+    summary.maxBack = 0.0f;
+    summary.maxSamples = 0;
+    summary.opaque = hasAlpha;
+
+    for (DD::Image::Box::iterator it = box.begin(); it != box.end(); it++) {
+      DD::Image::DeepPixel pixel = plane.getPixel(it);
+      const unsigned nSamples = pixel.getSampleCount();
+      if (nSamples == 0) {
+        summary.opaque = false;
+        continue;
+      }
+      if (summary.maxSamples == 0) {
+        summary.minFront = pixel.getUnorderedSample(0, DD::Image::Chan_DeepFront);
+        summary.maxBack = pixel.getUnorderedSample(0, DD::Image::Chan_DeepBack);
+      }
+      summary.maxSamples = MAX(summary.maxSamples, nSamples);
+
+      float transmission = 1.0f;
+      for (unsigned i = 0; i < nSamples; i++) {
+        summary.minFront = MIN(summary.minFront, pixel.getUnorderedSample(i, DD::Image::Chan_DeepFront));
+        summary.maxBack = MAX(summary.maxBack, pixel.getUnorderedSample(i, DD::Image::Chan_DeepBack));
+        if (hasAlpha)
+          transmission *= 1.0f - pixel.getUnorderedSample(i, DD::Image::Chan_Alpha);
+      }
+      // 'over' is order independent for alpha, so no sort is needed
+      if (transmission > 1e-6f)
+        summary.opaque = false;
+    }
+  }
+
+  /* The summary of box in input if it is in the index. */
+  bool find(DD::Image::DeepOp* input, const DD::Image::Box& box, DeepTileSummary& summary)
+  {
+    DD::Image::Guard guard(_lock);
+    reset(input->op()->hash());
+    TileMap::const_iterator found = _tiles.find(TileKey(box));
+    if (found == _tiles.end())
+      return false;
+    summary = found->second;
+    return true;
+  }
+
+  /* Summarise box of plane, which was fetched from input with at least
+     channels(), and remember it for input's current hash. */
+  void add(DD::Image::DeepOp* input, const DD::Image::Box& box, const DD::Image::DeepPlane& plane,
+           DeepTileSummary& summary)
+  {
+    summarise(plane, box, input->deepInfo().channels().contains(DD::Image::Chan_Alpha), summary);
+
+    DD::Image::Guard guard(_lock);
+    reset(input->op()->hash());
+    if (_tiles.size() >= DEEP_TILE_INDEX_SIZE)
+      _tiles.clear();
+    _tiles[TileKey(box)] = summary;
+  }
+
+private:
+  // forget every tile if the input has changed; call with _lock held
+  void reset(const DD::Image::Hash& inHash)
+  {
+    if (_hash != inHash) {
+      _hash = inHash;
+      _tiles.clear();
+    }
+  }
+};
+
+#endif // DEEP_TILE_INDEX_H
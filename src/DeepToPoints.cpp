@@ -0,0 +1,527 @@
+//
+//  DeepToPoints.cpp
+//  DeepToPoints Node for Nuke
+//
+//  Turns deep samples into a decimated point cloud for the 3D viewer.
+//
+
+static const char* const RCLASS = "DeepToPoints";
+
+static const char* const HELP = "Turns the samples of a deep image into a point cloud, placing each sample "
+                                "along its pixel's ray through the camera at the sample's front depth.\n"
+                                "The cloud is decimated on a voxel grid: each occupied cell becomes one point "
+                                "at the average position and colour of the samples in it. If the cloud still "
+                                "has more than max points, the cells are doubled in size until it fits, so "
+                                "the viewer stays responsive however many samples the image has.\n"
+                                "Without a camera, points are placed in front of a default camera at the origin.";
+
+#include "DDImage/SourceGeo.h"
+#include "DDImage/Scene.h"
+#include "DDImage/CameraOp.h"
+#include "DDImage/DeepOp.h"
+#include "DDImage/PointCloud.h"
+#include "DDImage/Knobs.h"
+#include "DDImage/Knob.h"
+#include "DDImage/Thread.h"
+
+#include <math.h>
+#include <stdint.h>
+#include <assert.h>
+#include <vector>
+#include <algorithm>
+#include <limits>
+
+using namespace DD::Image;
+
+// each voxel coordinate is packed into 21 bits of the sort key
+#define VOXEL_BITS 21
+#define VOXEL_MAX ((1u << VOXEL_BITS) - 1)
+
+// Nuke's default camera, used when none is connected
+#define DEFAULT_FOCAL 50.0
+#define DEFAULT_HAPERTURE 24.576
+
+/* Positions and colours of a cloud, with how many samples each point stands
+   for so repeated decimation still averages over the original samples. */
+struct PointSet
+{
+  std::vector<Vector3> P;
+  std::vector<Vector4> Cf;
+  std::vector<float> weight;
+
+  size_t size() const { return P.size(); }
+  void resize(size_t n)
+  {
+    P.resize(n);
+    Cf.resize(n);
+    weight.resize(n);
+  }
+};
+
+struct VoxelKey
+{
+  uint64_t key;
+  unsigned index;
+  bool operator<(const VoxelKey& b) const { return key < b.key; }
+};
+
+class DeepToPoints : public SourceGeo
+{
+  float _voxelSize;
+  int _maxPoints;
+
+  // the decimated cloud, built with the primitives
+  PointSet _cloud;
+
+  // Work shared with the threads of one pass. Slice i of the pass covers
+  // items bounds[i] .. bounds[i + 1] - 1.
+  enum { PASS_UNPROJECT, PASS_KEYS, PASS_REDUCE };
+  struct Job
+  {
+    int pass;
+    unsigned nThreads;
+    std::vector<size_t> bounds;
+
+    // PASS_UNPROJECT: rows of the plane, into out
+    const DeepPlane* plane;
+    Box box;
+    ChannelSet channels;
+    Matrix4 camera;
+    double scaleX, scaleY;    // camera space x/z and y/z per pixel
+    double centreX, centreY;  // pixel at the middle of the frame
+    std::vector<size_t> rowStart;
+    std::vector<Vector3> lo, hi;  // per thread bounds of the points
+
+    // PASS_KEYS / PASS_REDUCE: decimate in into out on a grid of size
+    const PointSet* in;
+    PointSet* out;
+    Vector3 origin;
+    float size;
+    std::vector<VoxelKey> keys;
+    std::vector<PointSet> reduced;
+  };
+
+protected:
+  void _validate(bool for_real)
+  {
+    if (DeepOp* deep = deepInput())
+      deep->validate(for_real);
+    if (Op::input(2))
+      Op::input(2)->validate(for_real);
+    SourceGeo::_validate(for_real);
+  }
+
+public:
+  static const Description description;
+  const char* Class() const { return RCLASS; }
+  const char* node_help() const { return HELP; }
+
+  DeepToPoints(Node* node) : SourceGeo(node)
+  {
+    _voxelSize = 0.0f;
+    _maxPoints = 500000;
+  }
+
+  int minimum_inputs() const { return 3; }
+  int maximum_inputs() const { return 3; }
+
+  bool test_input(int input, Op* op) const
+  {
+    if (input == 1)
+      return dynamic_cast<DeepOp*>(op) != NULL;
+    if (input == 2)
+      return dynamic_cast<CameraOp*>(op) != NULL;
+    return SourceGeo::test_input(input, op);
+  }
+
+  Op* default_input(int input) const
+  {
+    if (input >= 1)
+      return NULL;
+    return SourceGeo::default_input(input);
+  }
+
+  const char* input_label(int input, char* buffer) const
+  {
+    switch (input) {
+      case 1:
+        return "deep";
+      case 2:
+        return "cam";
+      default:
+        return SourceGeo::input_label(input, buffer);
+    }
+  }
+
+  DeepOp* deepInput() const
+  {
+    return dynamic_cast<DeepOp*>(Op::input(1));
+  }
+
+  void knobs(Knob_Callback f)
+  {
+    SourceGeo::knobs(f);
+    Float_knob(f, &_voxelSize, "voxel_size", "voxel size");
+    SetRange(f, 0, 1);
+    Tooltip(f, "Size of the decimation grid cells, in world units. 0 leaves the samples alone "
+               "unless there are more than max points.");
+    Int_knob(f, &_maxPoints, "max_points", "max points");
+    SetRange(f, 1000, 10000000);
+    Tooltip(f, "Most points to output. Above this the grid cells are made coarser until the cloud fits.");
+  }
+
+  // Hash up the inputs and knobs that affect the cloud:
+  void get_geometry_hash()
+  {
+    SourceGeo::get_geometry_hash(); // Get all hashes up-to-date
+
+    // The point count depends on everything, so it all goes in the
+    // primitives hash and the cloud is built in one go:
+    Hash h;
+    if (DeepOp* deep = deepInput())
+      h.append(deep->op()->hash());
+    if (Op::input(2))
+      h.append(Op::input(2)->hash());
+    h.append(_voxelSize);
+    h.append(_maxPoints);
+
+    geo_hash[Group_Primitives].append(h);
+    geo_hash[Group_Points].append(h);
+    geo_hash[Group_Attributes].append(h);
+  }
+
+  void create_geometry(Scene& scene, GeometryList& out)
+  {
+    int obj = 0;
+
+    //=============================================================
+    // Build the cloud and its primitive:
+    if (rebuild(Mask_Primitives)) {
+      buildCloud();
+
+      out.delete_objects();
+      out.add_object(obj);
+      out.add_primitive(obj, new PointCloud(unsigned(_cloud.size())));
+
+      // Force points and attributes to update:
+      set_rebuild(Mask_Points | Mask_Attributes);
+    }
+
+    //=============================================================
+    // Assign the point locations:
+    if (rebuild(Mask_Points)) {
+      PointList* points = out.writable_points(obj);
+      points->resize(_cloud.size());
+      for (size_t p = 0; p < _cloud.size(); p++)
+        (*points)[p] = _cloud.P[p];
+    }
+
+    //=============================================================
+    // Assign the colours:
+    if (rebuild(Mask_Attributes)) {
+      Attribute* Cf = out.writable_attribute(obj, Group_Points, "Cf", VECTOR4_ATTRIB);
+      assert(Cf);
+      for (size_t p = 0; p < _cloud.size(); p++)
+        Cf->vector4(p) = _cloud.Cf[p];
+    }
+  }
+
+private:
+  void buildCloud();
+  bool unproject(PointSet& points, Vector3& lo, Vector3& hi);
+  void decimate(const PointSet& in, const Vector3& origin, float size, PointSet& out);
+
+  static void thread(unsigned index, unsigned nThreads, void* d);
+  static void unprojectSlice(Job& job, unsigned index);
+  static void keySlice(Job& job, unsigned index);
+  static void reduceSlice(Job& job, unsigned index);
+
+  static unsigned threadCount(size_t items)
+  {
+    const size_t perThread = 4096; // not worth a thread below this
+    return unsigned(MAX(size_t(1), MIN(size_t(Thread::numCPUs), items / perThread)));
+  }
+
+  static void runJob(Job& job)
+  {
+    Thread::spawn(thread, job.nThreads, &job);
+    Thread::wait(&job);
+  }
+};
+
+void DeepToPoints::thread(unsigned index, unsigned nThreads, void* d)
+{
+  Job& job = *(Job*)d;
+  switch (job.pass) {
+    case PASS_UNPROJECT:
+      unprojectSlice(job, index);
+      break;
+    case PASS_KEYS:
+      keySlice(job, index);
+      break;
+    case PASS_REDUCE:
+      reduceSlice(job, index);
+      break;
+  }
+}
+
+/* Unproject the samples of the deep input into world space points, and
+   work out their bounds. */
+bool DeepToPoints::unproject(PointSet& points, Vector3& lo, Vector3& hi)
+{
+  DeepOp* deep = deepInput();
+  if (!deep)
+    return false;
+
+  const DeepInfo& info = deep->deepInfo();
+  const Box box = info.box();
+  if (box.w() <= 0 || box.h() <= 0)
+    return false;
+
+  ChannelSet channels = Mask_RGBA;
+  channels &= info.channels();
+  channels += Mask_Deep;
+
+  DeepPlane plane;
+  deep->deepRequest(box, channels);
+  if (!deep->deepEngine(box, channels, plane))
+    return false;
+
+  Job job;
+  job.pass = PASS_UNPROJECT;
+  job.plane = &plane;
+  job.box = box;
+  job.channels = channels;
+
+  // Pixels map to camera space x/z and y/z through the horizontal aperture,
+  // with square camera units across the width of the format:
+  double focal = DEFAULT_FOCAL, haperture = DEFAULT_HAPERTURE;
+  job.camera.makeIdentity();
+  if (CameraOp* cam = dynamic_cast<CameraOp*>(Op::input(2))) {
+    focal = cam->focal_length();
+    haperture = cam->film_width();
+    job.camera = cam->matrix();
+  }
+  const Format& format = *info.format();
+  const double width = MAX(format.width(), 1);
+  job.scaleX = haperture / (focal * width);
+  job.scaleY = job.scaleX / MAX(format.pixel_aspect(), 1e-6);
+  job.centreX = 0.5 * width;
+  job.centreY = 0.5 * format.height();
+
+  // First sample of each row, so the threads know where to write:
+  job.rowStart.resize(box.h() + 1);
+  job.rowStart[0] = 0;
+  for (int y = box.y(); y < box.t(); y++) {
+    size_t n = 0;
+    for (int x = box.x(); x < box.r(); x++)
+      n += plane.getPixel(y, x).getSampleCount();
+    job.rowStart[y - box.y() + 1] = job.rowStart[y - box.y()] + n;
+  }
+  points.resize(job.rowStart.back());
+  job.out = &points;
+
+  job.nThreads = unsigned(MIN(size_t(box.h()), size_t(threadCount(points.size()))));
+  job.bounds.resize(job.nThreads + 1);
+  for (unsigned i = 0; i <= job.nThreads; i++)
+    job.bounds[i] = size_t(box.h()) * i / job.nThreads;
+  job.lo.resize(job.nThreads);
+  job.hi.resize(job.nThreads);
+  runJob(job);
+
+  if (points.size() == 0)
+    return false;
+
+  const float inf = std::numeric_limits<float>::infinity();
+  lo.set(inf, inf, inf);
+  hi.set(-inf, -inf, -inf);
+  for (unsigned i = 0; i < job.nThreads; i++) {
+    lo.set(MIN(lo.x, job.lo[i].x), MIN(lo.y, job.lo[i].y), MIN(lo.z, job.lo[i].z));
+    hi.set(MAX(hi.x, job.hi[i].x), MAX(hi.y, job.hi[i].y), MAX(hi.z, job.hi[i].z));
+  }
+  return true;
+}
+
+void DeepToPoints::unprojectSlice(Job& job, unsigned index)
+{
+  const float inf = std::numeric_limits<float>::infinity();
+  Vector3 lo(inf, inf, inf), hi(-inf, -inf, -inf);
+
+  const bool hasColour[4] = { job.channels.contains(Chan_Red), job.channels.contains(Chan_Green),
+                              job.channels.contains(Chan_Blue), job.channels.contains(Chan_Alpha) };
+  const Channel colour[4] = { Chan_Red, Chan_Green, Chan_Blue, Chan_Alpha };
+
+  PointSet& out = *job.out;
+  for (size_t row = job.bounds[index]; row < job.bounds[index + 1]; row++) {
+    const int y = job.box.y() + int(row);
+    size_t s = job.rowStart[row];
+    const double cy = (y + 0.5 - job.centreY) * job.scaleY;
+
+    for (int x = job.box.x(); x < job.box.r(); x++) {
+      DeepPixel pixel = job.plane->getPixel(y, x);
+      const unsigned nSamples = pixel.getSampleCount();
+      const double cx = (x + 0.5 - job.centreX) * job.scaleX;
+
+      for (unsigned i = 0; i < nSamples; i++, s++) {
+        // the camera looks down -z; deep depth is distance along it
+        const double z = pixel.getUnorderedSample(i, Chan_DeepFront);
+        const Vector3 P = job.camera.transform(Vector3(float(cx * z), float(cy * z), float(-z)));
+        out.P[s] = P;
+        lo.set(MIN(lo.x, P.x), MIN(lo.y, P.y), MIN(lo.z, P.z));
+        hi.set(MAX(hi.x, P.x), MAX(hi.y, P.y), MAX(hi.z, P.z));
+
+        float c[4];
+        for (int k = 0; k < 4; k++)
+          c[k] = hasColour[k] ? pixel.getUnorderedSample(i, colour[k]) : (k == 3 ? 1.0f : 0.0f);
+        // unpremultiply, so points show the surface colour
+        if (hasColour[3] && c[3] > 0.0f) {
+          for (int k = 0; k < 3; k++)
+            c[k] /= c[3];
+        }
+        out.Cf[s].set(c[0], c[1], c[2], c[3]);
+        out.weight[s] = 1.0f;
+      }
+    }
+  }
+
+  job.lo[index] = lo;
+  job.hi[index] = hi;
+}
+
+/* Merge the points of in that share a cell of a grid of size, anchored at
+   origin, into one point at their weighted average. Each thread keys and
+   sorts a slice of the points, the slices are merged, then each thread
+   reduces a run of whole cells. */
+void DeepToPoints::decimate(const PointSet& in, const Vector3& origin, float size, PointSet& out)
+{
+  Job job;
+  job.in = &in;
+  job.origin = origin;
+  job.size = size;
+  job.keys.resize(in.size());
+
+  job.pass = PASS_KEYS;
+  job.nThreads = threadCount(in.size());
+  job.bounds.resize(job.nThreads + 1);
+  for (unsigned i = 0; i <= job.nThreads; i++)
+    job.bounds[i] = in.size() * i / job.nThreads;
+  runJob(job);
+
+  // Merge the sorted slices pairwise:
+  std::vector<VoxelKey>::iterator first = job.keys.begin();
+  for (unsigned width = 1; width < job.nThreads; width *= 2) {
+    for (unsigned i = 0; i + width < job.nThreads; i += 2 * width) {
+      const unsigned end = MIN(i + 2 * width, job.nThreads);
+      std::inplace_merge(first + job.bounds[i], first + job.bounds[i + width], first + job.bounds[end]);
+    }
+  }
+
+  // Split the sorted keys for the reduce, moving each split forward to the
+  // start of a cell so no cell is shared between threads:
+  for (unsigned i = 1; i < job.nThreads; i++) {
+    size_t b = MAX(job.bounds[i], job.bounds[i - 1]);
+    while (b > 0 && b < job.keys.size() && job.keys[b].key == job.keys[b - 1].key)
+      b++;
+    job.bounds[i] = b;
+  }
+  job.pass = PASS_REDUCE;
+  job.reduced.resize(job.nThreads);
+  runJob(job);
+
+  size_t total = 0;
+  for (unsigned i = 0; i < job.nThreads; i++)
+    total += job.reduced[i].size();
+  out.resize(total);
+  size_t p = 0;
+  for (unsigned i = 0; i < job.nThreads; i++) {
+    const PointSet& r = job.reduced[i];
+    std::copy(r.P.begin(), r.P.end(), out.P.begin() + p);
+    std::copy(r.Cf.begin(), r.Cf.end(), out.Cf.begin() + p);
+    std::copy(r.weight.begin(), r.weight.end(), out.weight.begin() + p);
+    p += r.size();
+  }
+}
+
+void DeepToPoints::keySlice(Job& job, unsigned index)
+{
+  const float inv = 1.0f / job.size;
+  const PointSet& in = *job.in;
+  for (size_t i = job.bounds[index]; i < job.bounds[index + 1]; i++) {
+    const Vector3 d = (in.P[i] - job.origin) * inv;
+    const uint64_t vx = uint64_t(MIN(MAX(d.x, 0.0f), float(VOXEL_MAX)));
+    const uint64_t vy = uint64_t(MIN(MAX(d.y, 0.0f), float(VOXEL_MAX)));
+    const uint64_t vz = uint64_t(MIN(MAX(d.z, 0.0f), float(VOXEL_MAX)));
+    job.keys[i].key = (vx << (2 * VOXEL_BITS)) | (vy << VOXEL_BITS) | vz;
+    job.keys[i].index = unsigned(i);
+  }
+  std::sort(job.keys.begin() + job.bounds[index], job.keys.begin() + job.bounds[index + 1]);
+}
+
+void DeepToPoints::reduceSlice(Job& job, unsigned index)
+{
+  const PointSet& in = *job.in;
+  PointSet& out = job.reduced[index];
+  const size_t end = job.bounds[index + 1];
+
+  for (size_t g = job.bounds[index]; g < end; ) {
+    Vector3 P(0.0f, 0.0f, 0.0f);
+    Vector4 Cf(0.0f, 0.0f, 0.0f, 0.0f);
+    float w = 0.0f;
+    size_t s = g;
+    for (; s < end && job.keys[s].key == job.keys[g].key; s++) {
+      const unsigned i = job.keys[s].index;
+      P += in.P[i] * in.weight[i];
+      Cf += in.Cf[i] * in.weight[i];
+      w += in.weight[i];
+    }
+    const float inv = 1.0f / w;
+    out.P.push_back(P * inv);
+    out.Cf.push_back(Cf * inv);
+    out.weight.push_back(w);
+    g = s;
+  }
+}
+
+/* Unproject the deep samples and decimate them, coarsening the grid until
+   the cloud fits in max points. */
+void DeepToPoints::buildCloud()
+{
+  PointSet points;
+  Vector3 lo, hi;
+  if (!unproject(points, lo, hi)) {
+    _cloud = PointSet();
+    return;
+  }
+
+  const size_t maxPoints = size_t(MAX(_maxPoints, 1));
+  const float extent = MAX(MAX(hi.x - lo.x, hi.y - lo.y), hi.z - lo.z);
+  // cells no smaller than the key can address across the extent:
+  const float minSize = MAX(extent / float(VOXEL_MAX), std::numeric_limits<float>::min());
+
+  float size = _voxelSize;
+  if (size <= 0.0f) {
+    if (points.size() <= maxPoints) {
+      _cloud.P.swap(points.P);
+      _cloud.Cf.swap(points.Cf);
+      _cloud.weight.swap(points.weight);
+      return;
+    }
+    // deep samples mostly lie on surfaces, so the count falls with the
+    // square of the cell size
+    size = extent / sqrtf(float(maxPoints));
+  }
+  size = MAX(size, minSize);
+
+  decimate(points, lo, size, _cloud);
+  while (_cloud.size() > maxPoints && !aborted()) {
+    size *= 2.0f;
+    PointSet coarser;
+    decimate(_cloud, lo, size, coarser);
+    _cloud.P.swap(coarser.P);
+    _cloud.Cf.swap(coarser.Cf);
+    _cloud.weight.swap(coarser.weight);
+  }
+}
+
+static Op* build(Node* node) { return new DeepToPoints(node); }
+const Op::Description DeepToPoints::description(RCLASS, build);
@@ -11,7 +11,7 @@ static const char *const HELP = "Generates a 3D Cylinder with variable-diameter
 
 #include "DDImage/SourceGeo.h"
 #include "DDImage/Scene.h"
-#include "DDImage/Triangle.h"
+#include "DDImage/PolyMesh.h"
 #include "DDImage/Knobs.h"
 #include "DDImage/Knob.h"
 #include "DDImage/Channel3D.h"
@@ -27,6 +27,13 @@ using namespace DD::Image;
 
 #define MAX_CYLINDER_TESSELATION 512
 
+// Add a triangle to mesh; its vertices follow the previous face's.
+static inline void add_triangle(PolyMesh* mesh, unsigned v0, unsigned v1, unsigned v2)
+{
+  const unsigned verts[3] = { v0, v1, v2 };
+  mesh->add_face(3, verts);
+}
+
 class TaperedCylinder : public SourceGeo
 {
 private:
@@ -195,6 +202,10 @@ public:
       out.delete_objects();
       out.add_object(obj);
 
+      // One mesh holds every triangle:
+      unsigned num_faces = (close_bottom ? columns : 0) + rows * columns * 2 + (close_top ? columns : 0);
+      PolyMesh* mesh = new PolyMesh(3 * num_faces, num_faces);
+
       // Create poly primitives:
       // Bottom endcap:
 
@@ -203,7 +214,7 @@ public:
         for (int i = 0; i < columns; i++) { 
           int i0 = i % columns; 
           int i1 = (i + 1) % columns; 
-          out.add_primitive(obj, new Triangle(0, i1 + j1, i0 + j1));
+          add_triangle(mesh, 0, i1 + j1, i0 + j1);
         }
       }
 
@@ -214,8 +225,8 @@ public:
           int i0 = i % columns;
           int i1 = (i+1) % columns;
 
-          out.add_primitive(obj, new Triangle(i0+j0, i1+j0, i0+j1));
-          out.add_primitive(obj, new Triangle(i0+j1, i1+j0, i1+j1));
+          add_triangle(mesh, i0+j0, i1+j0, i0+j1);
+          add_triangle(mesh, i0+j1, i1+j0, i1+j1);
         }  
       }
 
@@ -227,9 +238,10 @@ public:
         for (int i = 0; i < columns; i++) {
           int i0 = i % columns;
           int i1 = (i+1) % columns;
-          out.add_primitive(obj, new Triangle(i0+j0, i1+j0, top_point));
+          add_triangle(mesh, i0+j0, i1+j0, top_point);
         }
       }
+      out.add_primitive(obj, mesh);
 
       // Force points and attributes to update:5
       set_rebuild(Mask_Points | Mask_Attributes);
@@ -296,8 +308,10 @@ public:
       }
 
       // set pinnacle
-      (*points)[p].set(0.0f, height, 0.0f);
-      ++p;
+      if (close_top) {
+        (*points)[p].set(0.0f, height, 0.0f);
+        ++p;
+      }
 
     //=============================================================
     // Assign the normals and uvs:
@@ -313,7 +327,8 @@ public:
 
       //---------------------------------------------
       // UVs:
-      const Primitive** PRIMS = info.primitive_array();
+      // The mesh's vertices run in face order, three per triangle:
+      unsigned v = info.primitive(0)->vertex_offset();
 
       Attribute* uv = out.writable_attribute(obj, Group_Vertices, "uv", VECTOR4_ATTRIB);
       assert(uv);
@@ -328,7 +343,6 @@ public:
       if (close_bottom) {
         s = ss;
         for (int i = 0; i < columns; i++) {
-          unsigned v = (*PRIMS++)->vertex_offset();
           uv->vector4(v++).set(   s, 0.0f, 0.0f, 1.0f);
           uv->vector4(v++).set(s + ds, t + dt, 0.0f, 1.0f);
           uv->vector4(v++).set(   s, t + dt, 0.0f, 1.0f);
@@ -344,11 +358,9 @@ public:
       for (int j = 0; j < rows; j++) {
         s = ss;
         for (int i = 0; i < columns; i++) {
-          unsigned v = (*PRIMS++)->vertex_offset();
           uv->vector4(v++).set(   s,    t, 0.0f, 1.0f);
           uv->vector4(v++).set(s + ds,    t, 0.0f, 1.0f);
           uv->vector4(v++).set(   s, t + dt, 0.0f, 1.0f);
-          v = (*PRIMS++)->vertex_offset();
           uv->vector4(v++).set(   s, t + dt, 0.0f, 1.0f);
           uv->vector4(v++).set(s + ds,    t, 0.0f, 1.0f);
           uv->vector4(v++).set(s + ds, t + dt, 0.0f, 1.0f);
@@ -361,7 +373,6 @@ public:
       if (close_top) {
         s = ss;
         for (int i = 0; i < columns; i++) {
-          unsigned v = (*PRIMS++)->vertex_offset();
           uv->vector4(v++).set(   s,    t, 0.0f, 1.0f);
           uv->vector4(v++).set(s + ds,    t, 0.0f, 1.0f);
           uv->vector4(v++).set(   s, 1.0f, 0.0f, 1.0f);